@@ -0,0 +1,130 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <algorithm>
+
+#include "air.h"
+#include "integrate.h"
+
+// Cells solved per row, whole vectors for every kernel
+inline int air_span(int width) {
+	return (width + 7) & ~7;
+}
+
+void create_air(air_field & air, int world_width, int world_height) {
+	air.width = (world_width + AIR_CELL - 1) / AIR_CELL;
+	air.height = (world_height + AIR_CELL - 1) / AIR_CELL;
+	air.stride = air_span(air.width) + 2 * AIR_PAD;
+	size_t size = (size_t)(air.height + 2) * air.stride;
+	for (int i = 0; i < 2; i++) {
+		air.pressure[i] = new float[size];
+		air.vx[i] = new float[size];
+		air.vy[i] = new float[size];
+	}
+	air.open = new float[size];
+	air.push_x = new std::atomic<int32_t>[size];
+	air.push_y = new std::atomic<int32_t>[size];
+	air.push_p = new std::atomic<int32_t>[size];
+	clear_air(air);
+}
+
+void clear_air(air_field & air) {
+	size_t size = (size_t)(air.height + 2) * air.stride;
+	for (int i = 0; i < 2; i++) {
+		std::fill(air.pressure[i], air.pressure[i] + size, 0.0f);
+		std::fill(air.vx[i], air.vx[i] + size, 0.0f);
+		std::fill(air.vy[i], air.vy[i] + size, 0.0f);
+	}
+	air.current = 0;
+	std::fill(air.open, air.open + size, 0.0f);
+	for (int y = 1; y < air.height - 1; y++)
+		std::fill(air.open + air_index(air, 1, y), air.open + air_index(air, air.width - 1, y), 1.0f);
+	for (size_t i = 0; i < size; i++) {
+		air.push_x[i].store(0, std::memory_order_relaxed);
+		air.push_y[i].store(0, std::memory_order_relaxed);
+		air.push_p[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void destroy_air(air_field & air) {
+	for (int i = 0; i < 2; i++) {
+		delete[] air.pressure[i];
+		delete[] air.vx[i];
+		delete[] air.vy[i];
+	}
+	delete[] air.open;
+	delete[] air.push_x;
+	delete[] air.push_y;
+	delete[] air.push_p;
+}
+
+// New pressure of cell x in row r
+inline float solved_pressure(const air_rows & rows, int r, int x) {
+	float divergence = (rows.vx[r][x - 1] - rows.vx[r][x]) + (rows.vy[r - 1][x] - rows.vy[r][x]);
+	return (rows.pressure[r][x] + divergence * AIR_TSTEPP) * (rows.open[r][x] * AIR_PLOSS);
+}
+
+void solve_air_row(const air_rows & rows, int count) {
+	for (int x = 0; x < count; x++) {
+		float p = solved_pressure(rows, 1, x);
+		float right = solved_pressure(rows, 1, x + 1);
+		float below = solved_pressure(rows, 2, x);
+		float open = rows.open[1][x];
+		rows.pressure_out[x] = p;
+		rows.vx_out[x] = (rows.vx[1][x] + (p - right) * AIR_TSTEPV) * ((open * rows.open[1][x + 1]) * AIR_VLOSS);
+		rows.vy_out[x] = (rows.vy[1][x] + (p - below) * AIR_TSTEPV) * ((open * rows.open[2][x]) * AIR_VLOSS);
+	}
+}
+
+void fold_air_pushes(air_field & air, int y0, int y1) {
+	int c = air.current;
+	for (int y = y0; y < y1; y++) {
+		for (int i = air_index(air, 0, y); i < air_index(air, air.width, y); i++) {
+			int32_t px = air.push_x[i].load(std::memory_order_relaxed);
+			int32_t py = air.push_y[i].load(std::memory_order_relaxed);
+			int32_t pp = air.push_p[i].load(std::memory_order_relaxed);
+			if (!(px | py | pp))
+				continue;
+			air.vx[c][i] += px * (AIR_PUSH / AIR_PUSH_ONE);
+			air.vy[c][i] += py * (AIR_PUSH / AIR_PUSH_ONE);
+			air.pressure[c][i] += pp * (1.0f / AIR_PUSH_ONE);
+			air.push_x[i].store(0, std::memory_order_relaxed);
+			air.push_y[i].store(0, std::memory_order_relaxed);
+			air.push_p[i].store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+void solve_air(air_field & air, int y0, int y1) {
+	void (*solve_row)(const air_rows & rows, int count) = kernels.air ? kernels.air : solve_air_row;
+	int in = air.current, out = !air.current;
+	for (int y = y0; y < y1; y++) {
+		air_rows rows;
+		for (int r = 0; r < 3; r++) {
+			int i = air_index(air, 0, y + r - 1);
+			rows.pressure[r] = air.pressure[in] + i;
+			rows.vx[r] = air.vx[in] + i;
+			rows.vy[r] = air.vy[in] + i;
+			rows.open[r] = air.open + i;
+		}
+		int i = air_index(air, 0, y);
+		rows.pressure_out = air.pressure[out] + i;
+		rows.vx_out = air.vx[out] + i;
+		rows.vy_out = air.vy[out] + i;
+		solve_row(rows, air_span(air.width));
+	}
+}
@@ -0,0 +1,88 @@
+﻿// air.h : Coarse air over the world, one air cell for every AIR_CELL x
+// AIR_CELL block of cells. Pressure and velocity are solved once per step
+// after the atoms moved. Atoms are dragged towards the velocity of the air
+// they are in and the air takes up what they lose, gases add pressure.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#define AIR_CELL 4
+
+// Rows are padded with AIR_PAD closed cells either side and the grid with a
+// closed row above and below, so the solver reads past the edges unchecked
+#define AIR_PAD 8
+
+// Velocity and pressure moved into neighbouring air cells every step, stable
+// while their product stays below 0.5
+#define AIR_TSTEPV 0.4f
+#define AIR_TSTEPP 0.3f
+#define AIR_VLOSS 0.98f
+#define AIR_PLOSS 0.98f
+
+// Air velocity gained from the velocity an atom loses to drag, the mass of an
+// atom over that of the air of an air cell
+#define AIR_PUSH 0.05f
+// Air cells with at least this many solid cells are closed
+#define AIR_BLOCK_SOLIDS 8
+
+// Pushes are summed up in fixed point so the order atoms push in does not matter
+#define AIR_PUSH_ONE 4096.0f
+
+struct air_field {
+	int width;		// air cells
+	int height;
+	int stride;		// floats per padded row
+	int current;	// planes holding the last solved state
+	float * pressure[2];
+	float * vx[2];	// across the right edge of the air cell
+	float * vy[2];	// across the bottom edge
+	float * open;	// 1 where air flows, 0 in closed cells and along the border
+	// Pushes of the atoms since the last solve, indexed like the planes
+	std::atomic<int32_t> * push_x;
+	std::atomic<int32_t> * push_y;
+	std::atomic<int32_t> * push_p;
+};
+
+inline int air_index(const air_field & air, int ax, int ay) {
+	return (ay + 1) * air.stride + AIR_PAD + ax;
+}
+
+// Velocity in the middle of an air cell
+inline void air_velocity(const air_field & air, int index, float & vx, float & vy) {
+	vx = (air.vx[air.current][index - 1] + air.vx[air.current][index]) * 0.5f;
+	vy = (air.vy[air.current][index - air.stride] + air.vy[air.current][index]) * 0.5f;
+}
+
+// Rows y - 1, y and y + 1 of the last solved planes starting at cell 0, and
+// row y of the planes being solved. count is a multiple of 8 and may reach
+// past the grid, cells there are closed and come out as 0.
+struct air_rows {
+	const float * pressure[3];
+	const float * vx[3];
+	const float * vy[3];
+	const float * open[3];
+	float * pressure_out;
+	float * vx_out;
+	float * vy_out;
+};
+
+void create_air(air_field & air, int world_width, int world_height);
+void clear_air(air_field & air);
+void destroy_air(air_field & air);
+
+// Reference solver the kernels have to match bit for bit. The pressure is
+// updated first and the velocities from the updated pressures, which keeps
+// the air stable. Every cell recomputes the new pressure of its right and
+// lower neighbour, so the rows can be solved in any order:
+//   p'(x, y) = (p + ((vx(x - 1) - vx) + (vy(y - 1) - vy)) * AIR_TSTEPP) * (open * AIR_PLOSS)
+//   vx' = (vx + (p'(x, y) - p'(x + 1, y)) * AIR_TSTEPV) * ((open * open(x + 1)) * AIR_VLOSS)
+//   vy' = (vy + (p'(x, y) - p'(x, y + 1)) * AIR_TSTEPV) * ((open * open(y + 1)) * AIR_VLOSS)
+// Closed cells have no pressure and no air flows across their edges.
+void solve_air_row(const air_rows & rows, int count);
+
+// Adds the pushes of air rows [y0, y1) to the air and clears them
+void fold_air_pushes(air_field & air, int y0, int y1);
+// Solves air rows [y0, y1) into the planes current does not point at
+void solve_air(air_field & air, int y0, int y1);
@@ -0,0 +1,80 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <algorithm>
+
+#include "blocks.h"
+
+// Atoms fall into lighter cells below them, then slide down diagonally past a
+// lighter cell beside them, the random bit picking which top cell tries first.
+// On half of the steps light atoms also flow into an open cell beside them.
+uint8_t rearrange_block(int index) {
+	int classes[4], source[4] = { 0, 1, 2, 3 };
+	for (int i = 0; i < 4; i++)
+		classes[i] = (index >> (2 * i)) & 3;
+	int mirror = (index >> 8) & 1;
+	bool flow = (index >> 9) & 1;
+
+	auto sinks_into = [&](int a, int b) {
+		return classes[a] != BLOCK_OPEN && classes[a] != BLOCK_FIXED && classes[b] < classes[a];
+	};
+	auto swap_cells = [&](int a, int b) {
+		std::swap(classes[a], classes[b]);
+		std::swap(source[a], source[b]);
+	};
+
+	for (int column = 0; column < 2; column++)
+		if (sinks_into(column, column + 2))
+			swap_cells(column, column + 2);
+	for (int i = 0; i < 2; i++) {
+		int top = i ^ mirror, side = top ^ 1;
+		if (sinks_into(top, side) && sinks_into(top, side + 2))
+			swap_cells(top, side + 2);
+	}
+	if (flow) {
+		for (int left = 2; left >= 0; left -= 2) {
+			if ((classes[left] == BLOCK_LIGHT && classes[left + 1] == BLOCK_OPEN) || (classes[left] == BLOCK_OPEN && classes[left + 1] == BLOCK_LIGHT))
+				swap_cells(left, left + 1);
+		}
+	}
+	return (uint8_t)(source[0] | source[1] << 2 | source[2] << 4 | source[3] << 6);
+}
+
+struct block_rule_table {
+	uint8_t entries[BLOCK_RULES];
+
+	block_rule_table() {
+		for (int index = 0; index < BLOCK_RULES; index++)
+			entries[index] = rearrange_block(index);
+	}
+};
+
+const block_rule_table rule_table;
+const uint8_t * const block_rules = rule_table.entries;
+
+// No loads or branches per cell, so the classification vectorizes
+void block_indices(const uint8_t * top, const uint8_t * bottom, int blocks, uint64_t random, uint16_t * indices) {
+	const uint32_t bits = block_class_bits();
+	for (int n = 0; n < blocks; n++) {
+		uint32_t index = (bits >> (2 * top[2 * n])) & 3;
+		index |= ((bits >> (2 * top[2 * n + 1])) & 3) << 2;
+		index |= ((bits >> (2 * bottom[2 * n])) & 3) << 4;
+		index |= ((bits >> (2 * bottom[2 * n + 1])) & 3) << 6;
+		index |= (uint32_t)((random >> (2 * n)) & 3) << 8;
+		indices[n] = (uint16_t)index;
+	}
+}
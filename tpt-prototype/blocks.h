@@ -0,0 +1,80 @@
+﻿// blocks.h : Margolus block rule, the second movement engine for powder and
+// liquid. The world is cut into 2x2 blocks, shifted by one cell diagonally on
+// every other step, and each block is rearranged in one go by a table entry
+// picked by the classes of its four cells and two random bits.
+
+#pragma once
+
+#include <cstdint>
+
+#include "tpt-prototype.h"
+#include "elements.h"
+
+enum block_class {
+	BLOCK_OPEN,		// empty or displaced by every mover, gases
+	BLOCK_LIGHT,	// movers that sink below open cells, liquids
+	BLOCK_HEAVY,	// movers that also sink below light ones, powders
+	BLOCK_FIXED		// never rearranged, solids and fast particles
+};
+
+// Falling elements that slide off each other move by blocks
+constexpr bool block_mover(int type) {
+	return elements[type].gravity > 0.0f && elements[type].collision == COLLIDE_SLIDE;
+}
+
+// Movers are ranked by the movers they displace, other types are open when
+// every mover displaces them
+constexpr int block_class_of(int type) {
+	int rank = 0, movers = 0, displacing = 0;
+	for (int t = 0; t < TYPE_COUNT; t++) {
+		if (!block_mover(t))
+			continue;
+		movers++;
+		if (displaces(t, type))
+			displacing++;
+		if (block_mover(type) && displaces(type, t))
+			rank++;
+	}
+	if (block_mover(type))
+		return BLOCK_LIGHT + rank;
+	return displacing == movers ? BLOCK_OPEN : BLOCK_FIXED;
+}
+
+constexpr uint8_t block_mover_mask() {
+	uint8_t mask = 0;
+	for (int t = 0; t < TYPE_COUNT; t++)
+		if (block_mover(t))
+			mask |= 1 << t;
+	return mask;
+}
+
+// Two bits per type, so a row is classified with shifts instead of loads
+constexpr uint32_t block_class_bits() {
+	uint32_t bits = 0;
+	for (int t = 0; t < TYPE_COUNT; t++)
+		bits |= (uint32_t)block_class_of(t) << (2 * t);
+	return bits;
+}
+
+constexpr bool block_classes_fit() {
+	for (int t = 0; t < TYPE_COUNT; t++)
+		if (block_class_of(t) > BLOCK_FIXED || (block_mover(t) && block_class_of(t) == BLOCK_FIXED))
+			return false;
+	return true;
+}
+
+static_assert(block_classes_fit(), "more kinds of movers than block classes");
+static_assert(TYPE_COUNT <= 16, "block classes of a type have to fit in block_class_bits");
+
+// Cells of a block are numbered top left, top right, bottom left, bottom
+// right. An index holds the class of cell n in bits 2n and 2n + 1 and the
+// random bits above them, an entry the cell whose atom ends up in cell n in
+// bits 2n and 2n + 1.
+#define BLOCK_RULES 1024
+#define BLOCK_IDENTITY 0xE4
+
+extern const uint8_t * const block_rules;
+
+// Indices of the first blocks blocks of two rows starting on the left cell of
+// a block, block n takes bits 2n and 2n + 1 of random
+void block_indices(const uint8_t * top, const uint8_t * bottom, int blocks, uint64_t random, uint16_t * indices);
@@ -0,0 +1,342 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+
+#include "distributed.h"
+#include "profiler.h"
+
+int world_rank = 0;
+int world_ranks = 1;
+
+std::unique_ptr<halo_transport> transport;
+// Rows either side of a border the tiles next to it can read or write
+int reach = 0;
+std::vector<uint8_t> outgoing, incoming;
+
+// A neighbour that went away leaves the world in pieces, there is nothing to recover
+void lost_rank(int peer) {
+	*simulation_log << "rank " << world_rank << " lost rank " << peer << std::endl;
+	std::_Exit(EXIT_FAILURE);
+}
+
+void send_to(int peer, const std::vector<uint8_t> & message) {
+	if (!transport->send(peer, message.data(), message.size()))
+		lost_rank(peer);
+}
+
+void receive_from(int peer, std::vector<uint8_t> & message) {
+	if (!transport->receive(peer, message))
+		lost_rank(peer);
+}
+
+template<typename T>
+inline void append(std::vector<uint8_t> & out, const T * values, size_t count) {
+	const uint8_t * bytes = (const uint8_t *)values;
+	out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+template<typename T>
+inline void take(const uint8_t * & data, const uint8_t * end, T * values, size_t count, int peer) {
+	if ((size_t)(end - data) < count * sizeof(T))
+		lost_rank(peer);
+	memcpy(values, data, count * sizeof(T));
+	data += count * sizeof(T);
+}
+
+// Block layout:
+//   first and end row, first and end chunk row
+//   active flag of every chunk in the chunk rows
+//   processed and occupied bitplane words of every row
+//   type, vx, vy, x and y of every occupied cell, row by row
+// Atoms are sent in the layout of the build, every rank has to run the same one.
+void encode_block(atom_field * parts, int y0, int y1, int chunk_row0, int chunk_row1, std::vector<uint8_t> & out) {
+	int32_t bounds[4] = { y0, y1, chunk_row0, chunk_row1 };
+	append(out, bounds, 4);
+	for (int i = chunk_row0 * chunk_columns; i < chunk_row1 * chunk_columns; i++) {
+		uint8_t active = parts->chunks[i].active.load(std::memory_order_relaxed);
+		append(out, &active, 1);
+	}
+	for (int y = y0; y < y1; y++) {
+		for (int w = 0; w < bitplane_stride; w++) {
+			uint64_t words[2] = { parts->mutex[BIT(0, y) + w].load(std::memory_order_relaxed), parts->occupied[BIT(0, y) + w].load(std::memory_order_relaxed) };
+			append(out, words, 2);
+		}
+	}
+	for (int y = y0; y < y1; y++) {
+		for (int w = 0; w < bitplane_stride; w++) {
+			uint64_t bits = parts->occupied[BIT(0, y) + w].load(std::memory_order_relaxed);
+			while (bits) {
+				int x = w * 64 + count_trailing_zeros(bits);
+				bits &= bits - 1;
+				const atom_page * page = page_at(parts, x, y);
+				int i = CELL(x, y);
+				append(out, &page->type[i], 1);
+				append(out, &page->vx[i], 1);
+				append(out, &page->vy[i], 1);
+				append(out, &page->x[i], 1);
+				append(out, &page->y[i], 1);
+			}
+		}
+	}
+}
+
+// Replaces the rows of a block and wakes the chunks woken by the sender
+const uint8_t * decode_block(atom_field * parts, const uint8_t * data, const uint8_t * end, int peer) {
+	int32_t bounds[4];
+	take(data, end, bounds, 4, peer);
+	int y0 = bounds[0], y1 = bounds[1], chunk_row0 = bounds[2], chunk_row1 = bounds[3];
+	if (y0 < 0 || y1 > world_height || y0 > y1 || chunk_row0 < 0 || chunk_row1 > chunk_rows || chunk_row0 > chunk_row1)
+		lost_rank(peer);
+
+	for (int i = chunk_row0 * chunk_columns; i < chunk_row1 * chunk_columns; i++) {
+		uint8_t active;
+		take(data, end, &active, 1, peer);
+		if (active)
+			parts->chunks[i].active.store(true, std::memory_order_relaxed);
+	}
+
+	for (int y = y0; y < y1; y++) {
+		for (int x = 0; x < world_width; x += CHUNK_SIZE) {
+			atom_page * page = page_at(parts, x, y);
+			if (page != &empty_page)
+				memset(page->type + CELL(x, y), TYPE_NONE, CHUNK_SIZE);
+			parts->chunks[CHUNK(x, y)].dirty.store(true, std::memory_order_relaxed);
+		}
+		for (int w = 0; w < bitplane_stride; w++) {
+			uint64_t words[2];
+			take(data, end, words, 2, peer);
+			parts->mutex[BIT(0, y) + w].store(words[0], std::memory_order_relaxed);
+			parts->occupied[BIT(0, y) + w].store(words[1], std::memory_order_relaxed);
+		}
+	}
+	for (int y = y0; y < y1; y++) {
+		for (int w = 0; w < bitplane_stride; w++) {
+			uint64_t bits = parts->occupied[BIT(0, y) + w].load(std::memory_order_relaxed);
+			while (bits) {
+				int x = w * 64 + count_trailing_zeros(bits);
+				bits &= bits - 1;
+				atom_page * page = writable_page(parts, x, y);
+				int i = CELL(x, y);
+				take(data, end, &page->type[i], 1, peer);
+				take(data, end, &page->vx[i], 1, peer);
+				take(data, end, &page->vy[i], 1, peer);
+				take(data, end, &page->x[i], 1, peer);
+				take(data, end, &page->y[i], 1, peer);
+				if (page->type[i] == TYPE_NONE || page->type[i] >= TYPE_COUNT)
+					lost_rank(peer);
+			}
+		}
+	}
+	return data;
+}
+
+// Rows within reach of the border at row y, with the chunks the moves into
+// them may have woken
+void encode_border(atom_field * parts, int y, std::vector<uint8_t> & out) {
+	int y0 = std::max(y - reach, 0), y1 = std::min(y + reach, world_height);
+	int chunk_row0 = std::max(y0 - 1, 0) / CHUNK_SIZE;
+	int chunk_row1 = std::min(y1, world_height - 1) / CHUNK_SIZE + 1;
+	encode_block(parts, y0, y1, chunk_row0, chunk_row1, out);
+}
+
+// The tiles of a colour run in every other tile row, so at each border
+// exactly one side ran and sends. Sends go first, the direction of every
+// border only depends on the colour so no two ranks wait on each other.
+void exchange_halo(atom_field * parts, int colour) {
+	trace_scope scope("halo", colour);
+	int parity = colour >> 1;
+	bool upper_sends = world_rank > 0 && ((band_y0 / tile_height - 1) & 1) != parity;
+	bool lower_sends = world_rank + 1 < world_ranks && ((band_y1 / tile_height - 1) & 1) == parity;
+
+	if (upper_sends) {
+		outgoing.clear();
+		encode_border(parts, band_y0, outgoing);
+		send_to(world_rank - 1, outgoing);
+	}
+	if (lower_sends) {
+		outgoing.clear();
+		encode_border(parts, band_y1, outgoing);
+		send_to(world_rank + 1, outgoing);
+	}
+	if (world_rank > 0 && !upper_sends) {
+		receive_from(world_rank - 1, incoming);
+		if (decode_block(parts, incoming.data(), incoming.data() + incoming.size(), world_rank - 1) != incoming.data() + incoming.size())
+			lost_rank(world_rank - 1);
+	}
+	if (world_rank + 1 < world_ranks && !lower_sends) {
+		receive_from(world_rank + 1, incoming);
+		if (decode_block(parts, incoming.data(), incoming.data() + incoming.size(), world_rank + 1) != incoming.data() + incoming.size())
+			lost_rank(world_rank + 1);
+	}
+}
+
+// Air rows [y0, y1) as they are before the solve, open flags included
+void encode_air_rows(const air_field & air, int y0, int y1, std::vector<uint8_t> & out) {
+	int32_t rows[2] = { y0, y1 };
+	append(out, rows, 2);
+	for (int y = y0; y < y1; y++) {
+		int i = air_index(air, 0, y);
+		append(out, air.pressure[air.current] + i, air.width);
+		append(out, air.vx[air.current] + i, air.width);
+		append(out, air.vy[air.current] + i, air.width);
+		append(out, air.open + i, air.width);
+	}
+}
+
+void decode_air_rows(air_field & air, const std::vector<uint8_t> & message, int y0, int y1, int peer) {
+	const uint8_t * data = message.data(), * end = data + message.size();
+	int32_t rows[2];
+	take(data, end, rows, 2, peer);
+	if (rows[0] != y0 || rows[1] != y1)
+		lost_rank(peer);
+	for (int y = y0; y < y1; y++) {
+		int i = air_index(air, 0, y);
+		take(data, end, air.pressure[air.current] + i, air.width, peer);
+		take(data, end, air.vx[air.current] + i, air.width, peer);
+		take(data, end, air.vy[air.current] + i, air.width, peer);
+		take(data, end, air.open + i, air.width, peer);
+	}
+	if (data != end)
+		lost_rank(peer);
+}
+
+// Bands end on a chunk row and so on an air row. Each band also solves the
+// air row past either end, which reads one more row, so the two air rows
+// next to a border go across before every solve.
+void exchange_air(atom_field * parts) {
+	trace_scope scope("air halo");
+	air_field & air = parts->air;
+	int y0 = band_y0 / AIR_CELL, y1 = band_y1 / AIR_CELL;
+	if (world_rank > 0) {
+		outgoing.clear();
+		encode_air_rows(air, y0, y0 + 2, outgoing);
+		send_to(world_rank - 1, outgoing);
+	}
+	if (world_rank + 1 < world_ranks) {
+		outgoing.clear();
+		encode_air_rows(air, y1 - 2, y1, outgoing);
+		send_to(world_rank + 1, outgoing);
+	}
+	if (world_rank > 0) {
+		receive_from(world_rank - 1, incoming);
+		decode_air_rows(air, incoming, y0 - 2, y0, world_rank - 1);
+	}
+	if (world_rank + 1 < world_ranks) {
+		receive_from(world_rank + 1, incoming);
+		decode_air_rows(air, incoming, y1, y1 + 2, world_rank + 1);
+	}
+}
+
+bool join_world(halo_transport * transport_, int rank, int ranks) {
+	transport.reset(transport_);
+	world_rank = rank;
+	world_ranks = ranks;
+
+	// Bands start on a tile row and on a chunk row, so every chunk is simulated by one rank
+	tile_width = std::max(tile_width, TILE_MIN_SIZE);
+	tile_height = std::max(tile_height, TILE_MIN_SIZE);
+	int unit = tile_height;
+	while (unit % CHUNK_SIZE)
+		unit += tile_height;
+	int units = (world_height + unit - 1) / unit;
+	if (units < ranks) {
+		*simulation_log << "a world of " << world_height << " rows can not be split into " << ranks << " bands of " << unit << " rows" << std::endl;
+		leave_world();
+		return false;
+	}
+	band_y0 = units * rank / ranks * unit;
+	band_y1 = std::min(units * (rank + 1) / ranks * unit, world_height);
+	reach = std::min(tile_width, tile_height) / 2;
+	tile_colour_done = exchange_halo;
+	air_pushes_done = exchange_air;
+
+	*simulation_log << "rank " << rank << " of " << ranks << " simulates rows " << band_y0 << " to " << band_y1 << std::endl;
+	return true;
+}
+
+void leave_world() {
+	transport.reset();
+	world_rank = 0;
+	world_ranks = 1;
+	band_y0 = 0;
+	band_y1 = world_height;
+	tile_colour_done = nullptr;
+	air_pushes_done = nullptr;
+}
+
+void trim_to_band(atom_field * parts) {
+	int keep0 = std::max(band_y0 - reach - 1, 0) / CHUNK_SIZE;
+	int keep1 = std::min(band_y1 + reach, world_height - 1) / CHUNK_SIZE + 1;
+	for (int chunk_row = 0; chunk_row < chunk_rows; chunk_row++) {
+		if (chunk_row >= keep0 && chunk_row < keep1)
+			continue;
+		for (int i = chunk_row * chunk_columns; i < (chunk_row + 1) * chunk_columns; i++) {
+			free_page(parts, i);
+			chunk_state & chunk = parts->chunks[i];
+			chunk.active.store(false, std::memory_order_relaxed);
+			chunk.idle_steps = 0;
+			for (int t = 0; t < TYPE_COUNT; t++)
+				chunk.partcount[t].store(0, std::memory_order_relaxed);
+		}
+		for (int y = chunk_row * CHUNK_SIZE; y < std::min((chunk_row + 1) * CHUNK_SIZE, world_height); y++) {
+			for (int w = 0; w < bitplane_stride; w++) {
+				parts->mutex[BIT(0, y) + w].store(0, std::memory_order_relaxed);
+				parts->occupied[BIT(0, y) + w].store(0, std::memory_order_relaxed);
+			}
+		}
+	}
+}
+
+// Both collect towards rank 0 along the chain of neighbours
+void gather_world(atom_field * parts) {
+	if (world_ranks == 1)
+		return;
+	incoming.clear();
+	if (world_rank + 1 < world_ranks)
+		receive_from(world_rank + 1, incoming);
+	if (world_rank) {
+		outgoing.clear();
+		encode_block(parts, band_y0, band_y1, 0, 0, outgoing);
+		outgoing.insert(outgoing.end(), incoming.begin(), incoming.end());
+		send_to(world_rank - 1, outgoing);
+		return;
+	}
+	const uint8_t * data = incoming.data(), * end = data + incoming.size();
+	while (data != end)
+		data = decode_block(parts, data, end, 1);
+}
+
+void reduce_sum(std::vector<double> & values) {
+	if (world_ranks == 1)
+		return;
+	if (world_rank + 1 < world_ranks) {
+		receive_from(world_rank + 1, incoming);
+		if (incoming.size() != values.size() * sizeof(double))
+			lost_rank(world_rank + 1);
+		const double * sums = (const double *)incoming.data();
+		for (size_t i = 0; i < values.size(); i++)
+			values[i] += sums[i];
+	}
+	if (world_rank) {
+		outgoing.clear();
+		append(outgoing, values.data(), values.size());
+		send_to(world_rank - 1, outgoing);
+	}
+}
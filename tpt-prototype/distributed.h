@@ -0,0 +1,32 @@
+﻿// distributed.h : Splits the world into bands of whole tile rows simulated by
+// separate processes. Tiles of one colour never move atoms further than half
+// a tile, so after every colour the side of a border whose tiles just ran
+// sends the rows within that reach to the other side, and before the air is
+// solved both sides swap the air rows next to the border. A split run ends up
+// identical to a single process run with the same tile size.
+
+#pragma once
+
+#include <vector>
+
+#include "simulation.h"
+#include "transport.h"
+
+// This process and the number of processes sharing the world, 0 of 1 unless split
+extern int world_rank;
+extern int world_ranks;
+
+// Takes over the transport and splits the world made by create_atom_field
+// between the ranks. Call after picking the tile size and before
+// init_simulation. Returns false with the reason on simulation_log when the
+// world has fewer tile rows than there are ranks.
+bool join_world(halo_transport * transport, int rank, int ranks);
+void leave_world();
+
+// Every rank builds or loads the whole world, this frees what lies out of
+// reach of its own band. Only between steps.
+void trim_to_band(atom_field * parts);
+// Copies the bands of all ranks into the field of rank 0, only between steps
+void gather_world(atom_field * parts);
+// Adds values up over all ranks, rank 0 ends up with the sums
+void reduce_sum(std::vector<double> & values);
@@ -0,0 +1,71 @@
+﻿// elements.h : Behaviour of every element type, fixed at compile time. The
+// update of an atom is instantiated once per type from these traits, and the
+// tables the SIMD kernels load are derived from them as well.
+
+#pragma once
+
+#include <cstdint>
+
+#include "tpt-prototype.h"
+
+#define GRAVITYAY 0.5f
+#define VLOSS 0.99f
+#define DIFFUSION 0.2f
+#define GAS_PRESSURE 0.01f
+
+// What an atom does when the cell it moves to is taken
+enum collision_rule {
+	COLLIDE_STOP,		// keeps its velocity and waits
+	COLLIDE_REFLECT,	// bounces off along one axis, gases
+	COLLIDE_SLIDE		// tries each axis and then slides sideways, liquids and powders
+};
+
+struct element_traits {
+	float loss;			// velocity kept every step
+	float gravity;		// added to vy every step
+	float diffusion;	// scale of the random walk
+	bool moves;			// static elements never leave their cell
+	uint8_t displaces;	// bit n set when the element can move into a cell of type n
+	collision_rule collision;
+	float air_drag;		// share of the difference to the air velocity taken on every step
+	float air_pressure;	// added to the pressure of its air cell every step
+};
+
+#define DISPLACES(type) (1 << (type))
+
+constexpr element_traits elements[TYPE_COUNT] = {
+	// TYPE_NONE
+	{ 1.0f, 0.0f, 0.0f, false, 0, COLLIDE_STOP, 0.0f, 0.0f },
+	// TYPE_SOLID
+	{ 1.0f, 0.0f, 0.0f, false, 0, COLLIDE_STOP, 0.0f, 0.0f },
+	// TYPE_POWDER
+	{ VLOSS, GRAVITYAY, 0.0f, true, DISPLACES(TYPE_NONE) | DISPLACES(TYPE_LIQUID) | DISPLACES(TYPE_GAS), COLLIDE_SLIDE, 0.02f, 0.0f },
+	// TYPE_LIQUID
+	{ VLOSS, GRAVITYAY, DIFFUSION * 0.1f, true, DISPLACES(TYPE_NONE) | DISPLACES(TYPE_GAS), COLLIDE_SLIDE, 0.01f, 0.0f },
+	// TYPE_GAS
+	{ VLOSS, 0.0f, DIFFUSION, true, DISPLACES(TYPE_NONE) | DISPLACES(TYPE_GAS), COLLIDE_REFLECT, 0.2f, GAS_PRESSURE },
+	// TYPE_PARTICLE
+	{ 1.0f, 0.0f, 0.0f, true, 0xFF, COLLIDE_STOP, 0.0f, 0.0f },
+};
+
+constexpr bool displaces(uint8_t mover, uint8_t target) {
+	return (elements[mover].displaces >> target) & 1;
+}
+
+// Neighbours of these types can move into a cell of the given type
+constexpr uint8_t displaced_by_mask(uint8_t type) {
+	uint8_t mask = 0;
+	for (int neighbour = 0; neighbour < TYPE_COUNT; neighbour++)
+		if (displaces(neighbour, type))
+			mask |= 1 << neighbour;
+	return mask;
+}
+
+// Largest share of the air velocity any element picks up in a step
+constexpr float max_air_drag() {
+	float drag = 0.0f;
+	for (int type = 0; type < TYPE_COUNT; type++)
+		if (elements[type].air_drag > drag)
+			drag = elements[type].air_drag;
+	return drag;
+}
@@ -0,0 +1,111 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include "integrate.h"
+
+#if defined(TPT_SIMD_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+kernel_isa kernel = KERNEL_SCALAR;
+kernel_table kernels{ nullptr, nullptr, nullptr };
+
+#ifdef TPT_SIMD_X86
+#ifdef _MSC_VER
+static bool cpu_has_sse41() {
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] >> 19) & 1;
+}
+
+static bool cpu_has_avx2() {
+	int info[4];
+	__cpuid(info, 1);
+	// The OS has to save the upper halves of the ymm registers
+	if (!((info[2] >> 27) & 1) || !((info[2] >> 28) & 1) || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] >> 5) & 1;
+}
+#else
+static bool cpu_has_sse41() {
+	return __builtin_cpu_supports("sse4.1");
+}
+
+static bool cpu_has_avx2() {
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+#endif
+
+bool kernel_isa_supported(kernel_isa isa) {
+	switch (isa) {
+	case KERNEL_SCALAR:
+		return true;
+#ifdef TPT_SIMD_X86
+	case KERNEL_SSE41:
+		return cpu_has_sse41();
+	case KERNEL_AVX2:
+		return cpu_has_avx2();
+#endif
+	default:
+		return false;
+	}
+}
+
+kernel_isa detect_kernel_isa() {
+	if (kernel_isa_supported(KERNEL_AVX2))
+		return KERNEL_AVX2;
+	if (kernel_isa_supported(KERNEL_SSE41))
+		return KERNEL_SSE41;
+	return KERNEL_SCALAR;
+}
+
+bool select_kernel(kernel_isa isa) {
+	if (!kernel_isa_supported(isa))
+		return false;
+
+	kernel = isa;
+	switch (isa) {
+#ifdef TPT_SIMD_X86
+	case KERNEL_SSE41:
+		kernels = { integrate_sse41, neighbours_sse41, air_sse41 };
+		break;
+	case KERNEL_AVX2:
+		kernels = { integrate_avx2, neighbours_avx2, air_avx2 };
+		break;
+#endif
+	default:
+		kernels = { nullptr, nullptr, nullptr };
+		break;
+	}
+	return true;
+}
+
+const char * kernel_isa_name(kernel_isa isa) {
+	switch (isa) {
+	case KERNEL_SSE41:
+		return "sse41";
+	case KERNEL_AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+// Pick the widest kernels before anything is simulated
+static bool kernels_selected = select_kernel(detect_kernel_isa());
@@ -0,0 +1,115 @@
+﻿// integrate.h : Integration and neighbour scan of a cell and the air solver,
+// plus batched SSE4.1 and AVX2 kernels picked at runtime. The kernels produce
+// results bit identical to the per cell code, so the choice never changes the
+// simulation.
+
+#pragma once
+
+#include <cstdint>
+
+#include "simulation.h"
+#include "elements.h"
+
+// Cells handled by one kernel call, always starting at a cell with x >= 1
+#define INTEGRATE_BATCH 16
+
+// Neighbour rows of a batch, cell x of rows y - 1, y and y + 1, each readable
+// from x - 1 to x + INTEGRATE_BATCH
+typedef const uint8_t * neighbour_rows[3];
+
+// Element traits laid out for vector lookups, velocities are updated as
+//   vx = vx * loss + noise_x * diffusion
+//   vy = (vy * loss + gravity) + noise_y * diffusion
+// The noise comes from the rng_stream of the cell and is only added once the
+// cell is actually processed, the kernels compute the rest.
+struct type_coefficients {
+	float loss[8];
+	float gravity[8];
+	float diffusion[8];
+	uint8_t displaced_by[16];	// bit n set when a neighbour of type n can move into the type
+};
+
+constexpr type_coefficients make_coefficients() {
+	type_coefficients table = {};
+	for (int type = 0; type < TYPE_COUNT; type++) {
+		table.loss[type] = elements[type].loss;
+		table.gravity[type] = elements[type].gravity;
+		table.diffusion[type] = elements[type].diffusion;
+		table.displaced_by[type] = displaced_by_mask(type);
+	}
+	return table;
+}
+
+constexpr type_coefficients coefficients = make_coefficients();
+
+struct integrate_batch {
+	float vx[INTEGRATE_BATCH];
+	float vy[INTEGRATE_BATCH];
+};
+
+struct neighbour_batch {
+	uint8_t space[INTEGRATE_BATCH];		// empty neighbours
+	uint8_t diverse[INTEGRATE_BATCH];	// neighbours of another type
+	uint8_t blocking[INTEGRATE_BATCH];	// 1 when no neighbour is empty or displaceable
+};
+
+enum kernel_isa {
+	KERNEL_SCALAR,
+	KERNEL_SSE41,
+	KERNEL_AVX2
+};
+
+// All are null for the scalar isa, which uses the per cell functions below
+// and solve_air_row
+struct kernel_table {
+	// Velocities of the cells from type, vx and vy on without the noise term
+	void (*integrate)(const uint8_t * type, const atom_velocity * vx, const atom_velocity * vy, integrate_batch & batch);
+	void (*neighbours)(const neighbour_rows & rows, neighbour_batch & batch);
+	void (*air)(const air_rows & rows, int count);
+};
+
+extern kernel_isa kernel;
+extern kernel_table kernels;
+
+kernel_isa detect_kernel_isa();
+bool kernel_isa_supported(kernel_isa isa);
+// Returns false and keeps the current kernels when the CPU lacks the isa
+bool select_kernel(kernel_isa isa);
+const char * kernel_isa_name(kernel_isa isa);
+
+#ifdef TPT_SIMD_X86
+void integrate_sse41(const uint8_t * type, const atom_velocity * vx, const atom_velocity * vy, integrate_batch & batch);
+void neighbours_sse41(const neighbour_rows & rows, neighbour_batch & batch);
+void air_sse41(const air_rows & rows, int count);
+void integrate_avx2(const uint8_t * type, const atom_velocity * vx, const atom_velocity * vy, integrate_batch & batch);
+void neighbours_avx2(const neighbour_rows & rows, neighbour_batch & batch);
+void air_avx2(const air_rows & rows, int count);
+#endif
+
+template<int TYPE>
+inline void integrate_cell(atom_page * page, int i) {
+	float vy = load_velocity(page->vy[i]) * elements[TYPE].loss;
+	page->vx[i] = store_velocity(load_velocity(page->vx[i]) * elements[TYPE].loss);
+	page->vy[i] = store_velocity(vy + elements[TYPE].gravity);
+}
+
+template<int TYPE>
+inline void scan_neighbours(const neighbour_rows & rows, int & space, int & diverse, bool & blocking) {
+	space = diverse = 0;
+	blocking = true;
+	for (int nx = -1; nx < 2; nx++)
+		for (int ny = -1; ny < 2; ny++) {
+			if (nx || ny) {
+				uint8_t neighbour = rows[ny + 1][nx];
+				if (neighbour == TYPE_NONE)
+				{
+					space++;
+					blocking = false;
+				}
+				if (neighbour != TYPE)
+					diverse++;
+				if ((coefficients.displaced_by[TYPE] >> neighbour) & 1)
+					blocking = false;
+			}
+		}
+}
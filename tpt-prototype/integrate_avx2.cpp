@@ -0,0 +1,121 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+// Built with AVX2 enabled, only reached through the kernel table once the
+// CPU is known to support it. Nothing here may call inline functions shared
+// with the rest of the program.
+
+#include <cstring>
+#include <immintrin.h>
+
+#include "integrate.h"
+
+// Eight stored velocities as floats, converted exactly like load_velocity
+static inline __m256 load_velocities_avx2(const atom_velocity * v) {
+#ifdef TPT_COMPACT_ATOMS
+	__m256i wide = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)v));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(wide), _mm256_set1_ps(1.0f / VELOCITY_ONE));
+#else
+	return _mm256_loadu_ps(v);
+#endif
+}
+
+void integrate_avx2(const uint8_t * type, const atom_velocity * vx, const atom_velocity * vy, integrate_batch & batch) {
+	__m256 loss_table = _mm256_loadu_ps(coefficients.loss);
+	__m256 gravity_table = _mm256_loadu_ps(coefficients.gravity);
+
+	for (int k = 0; k < INTEGRATE_BATCH; k += 8) {
+		int64_t packed;
+		memcpy(&packed, &type[k], sizeof(packed));
+		__m256i types = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(packed));
+
+		__m256 loss = _mm256_permutevar8x32_ps(loss_table, types);
+		__m256 gravity = _mm256_permutevar8x32_ps(gravity_table, types);
+
+		// Multiplies and adds stay separate so the results match the scalar kernel
+		__m256 x = _mm256_mul_ps(load_velocities_avx2(&vx[k]), loss);
+		__m256 y = _mm256_mul_ps(load_velocities_avx2(&vy[k]), loss);
+		y = _mm256_add_ps(y, gravity);
+		_mm256_storeu_ps(&batch.vx[k], x);
+		_mm256_storeu_ps(&batch.vy[k], y);
+	}
+}
+
+void neighbours_avx2(const neighbour_rows & rows, neighbour_batch & batch) {
+	const uint8_t * row = rows[1];
+	__m128i type_bits128 = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i types128 = _mm_loadu_si128((const __m128i *)row);
+	__m128i movable128 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)coefficients.displaced_by), types128);
+
+	// The eight neighbours are loaded in pairs, one per 128 bit half
+	const uint8_t * pairs[4][2] = {
+		{ rows[0] - 1, rows[2] - 1 },
+		{ rows[0], rows[2] },
+		{ rows[0] + 1, rows[2] + 1 },
+		{ row - 1, row + 1 }
+	};
+
+	__m256i zero = _mm256_setzero_si256();
+	__m256i type_bits = _mm256_broadcastsi128_si256(type_bits128);
+	__m256i types = _mm256_broadcastsi128_si256(types128);
+	__m256i movable = _mm256_broadcastsi128_si256(movable128);
+
+	__m256i space = zero, same = zero, freed = zero;
+	for (int pair = 0; pair < 4; pair++) {
+		__m128i first = _mm_loadu_si128((const __m128i *)pairs[pair][0]);
+		__m128i second = _mm_loadu_si128((const __m128i *)pairs[pair][1]);
+		__m256i neighbour = _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+		__m256i empty = _mm256_cmpeq_epi8(neighbour, zero);
+		// Comparison masks are -1, subtracting them counts
+		space = _mm256_sub_epi8(space, empty);
+		same = _mm256_sub_epi8(same, _mm256_cmpeq_epi8(neighbour, types));
+		freed = _mm256_or_si256(freed, empty);
+		freed = _mm256_or_si256(freed, _mm256_and_si256(_mm256_shuffle_epi8(type_bits, neighbour), movable));
+	}
+
+	__m128i space128 = _mm_add_epi8(_mm256_castsi256_si128(space), _mm256_extracti128_si256(space, 1));
+	__m128i same128 = _mm_add_epi8(_mm256_castsi256_si128(same), _mm256_extracti128_si256(same, 1));
+	__m128i freed128 = _mm_or_si128(_mm256_castsi256_si128(freed), _mm256_extracti128_si256(freed, 1));
+
+	_mm_storeu_si128((__m128i *)batch.space, space128);
+	_mm_storeu_si128((__m128i *)batch.diverse, _mm_sub_epi8(_mm_set1_epi8(8), same128));
+	_mm_storeu_si128((__m128i *)batch.blocking, _mm_and_si128(_mm_cmpeq_epi8(freed128, _mm_setzero_si128()), _mm_set1_epi8(1)));
+}
+
+// New pressure of the cells from x on in row r, as solved_pressure
+static inline __m256 solved_pressure_avx2(const air_rows & rows, int r, int x) {
+	__m256 divergence = _mm256_add_ps(_mm256_sub_ps(_mm256_loadu_ps(rows.vx[r] + x - 1), _mm256_loadu_ps(rows.vx[r] + x)),
+		_mm256_sub_ps(_mm256_loadu_ps(rows.vy[r - 1] + x), _mm256_loadu_ps(rows.vy[r] + x)));
+	__m256 pressure = _mm256_add_ps(_mm256_loadu_ps(rows.pressure[r] + x), _mm256_mul_ps(divergence, _mm256_set1_ps(AIR_TSTEPP)));
+	return _mm256_mul_ps(pressure, _mm256_mul_ps(_mm256_loadu_ps(rows.open[r] + x), _mm256_set1_ps(AIR_PLOSS)));
+}
+
+void air_avx2(const air_rows & rows, int count) {
+	__m256 tstepv = _mm256_set1_ps(AIR_TSTEPV), vloss = _mm256_set1_ps(AIR_VLOSS);
+	// Same operations in the same order as solve_air_row
+	for (int x = 0; x < count; x += 8) {
+		__m256 p = solved_pressure_avx2(rows, 1, x);
+		__m256 right = solved_pressure_avx2(rows, 1, x + 1);
+		__m256 below = solved_pressure_avx2(rows, 2, x);
+		__m256 open = _mm256_loadu_ps(rows.open[1] + x);
+		__m256 vx = _mm256_add_ps(_mm256_loadu_ps(rows.vx[1] + x), _mm256_mul_ps(_mm256_sub_ps(p, right), tstepv));
+		__m256 vy = _mm256_add_ps(_mm256_loadu_ps(rows.vy[1] + x), _mm256_mul_ps(_mm256_sub_ps(p, below), tstepv));
+		_mm256_storeu_ps(rows.pressure_out + x, p);
+		_mm256_storeu_ps(rows.vx_out + x, _mm256_mul_ps(vx, _mm256_mul_ps(_mm256_mul_ps(open, _mm256_loadu_ps(rows.open[1] + x + 1)), vloss)));
+		_mm256_storeu_ps(rows.vy_out + x, _mm256_mul_ps(vy, _mm256_mul_ps(_mm256_mul_ps(open, _mm256_loadu_ps(rows.open[2] + x)), vloss)));
+	}
+}
@@ -0,0 +1,117 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+// Built with SSE4.1 enabled, only reached through the kernel table once the
+// CPU is known to support it. Nothing here may call inline functions shared
+// with the rest of the program.
+
+#include <cstring>
+#include <smmintrin.h>
+
+#include "integrate.h"
+
+// Looks up a float per lane from an 8 entry table indexed by four type bytes
+static inline __m128 lookup_sse41(__m128i table_lo, __m128i table_hi, __m128i types) {
+	// Expand every type t to the byte offsets 4t .. 4t + 3 of its entry
+	__m128i offsets = _mm_shuffle_epi8(types, _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3));
+	offsets = _mm_add_epi8(_mm_slli_epi16(offsets, 2), _mm_setr_epi8(0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3));
+	__m128i lo = _mm_shuffle_epi8(table_lo, offsets);
+	__m128i hi = _mm_shuffle_epi8(table_hi, offsets);
+	return _mm_castsi128_ps(_mm_blendv_epi8(lo, hi, _mm_cmpgt_epi8(offsets, _mm_set1_epi8(15))));
+}
+
+// Four stored velocities as floats, converted exactly like load_velocity
+static inline __m128 load_velocities_sse41(const atom_velocity * v) {
+#ifdef TPT_COMPACT_ATOMS
+	__m128i wide = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *)v));
+	return _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(1.0f / VELOCITY_ONE));
+#else
+	return _mm_loadu_ps(v);
+#endif
+}
+
+void integrate_sse41(const uint8_t * type, const atom_velocity * vx, const atom_velocity * vy, integrate_batch & batch) {
+	__m128i loss_lo = _mm_loadu_si128((const __m128i *)&coefficients.loss[0]);
+	__m128i loss_hi = _mm_loadu_si128((const __m128i *)&coefficients.loss[4]);
+	__m128i gravity_lo = _mm_loadu_si128((const __m128i *)&coefficients.gravity[0]);
+	__m128i gravity_hi = _mm_loadu_si128((const __m128i *)&coefficients.gravity[4]);
+
+	for (int k = 0; k < INTEGRATE_BATCH; k += 4) {
+		int32_t packed;
+		memcpy(&packed, &type[k], sizeof(packed));
+		__m128i types = _mm_cvtsi32_si128(packed);
+
+		__m128 loss = lookup_sse41(loss_lo, loss_hi, types);
+		__m128 gravity = lookup_sse41(gravity_lo, gravity_hi, types);
+
+		__m128 x = _mm_mul_ps(load_velocities_sse41(&vx[k]), loss);
+		__m128 y = _mm_mul_ps(load_velocities_sse41(&vy[k]), loss);
+		y = _mm_add_ps(y, gravity);
+		_mm_storeu_ps(&batch.vx[k], x);
+		_mm_storeu_ps(&batch.vy[k], y);
+	}
+}
+
+void neighbours_sse41(const neighbour_rows & rows, neighbour_batch & batch) {
+	const uint8_t * row = rows[1];
+	__m128i zero = _mm_setzero_si128();
+	__m128i type_bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i types = _mm_loadu_si128((const __m128i *)row);
+	__m128i movable = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)coefficients.displaced_by), types);
+
+	__m128i space = zero, same = zero, freed = zero;
+	for (int ny = -1; ny < 2; ny++)
+		for (int nx = -1; nx < 2; nx++) {
+			if (!nx && !ny)
+				continue;
+			__m128i neighbour = _mm_loadu_si128((const __m128i *)(rows[ny + 1] + nx));
+			__m128i empty = _mm_cmpeq_epi8(neighbour, zero);
+			// Comparison masks are -1, subtracting them counts
+			space = _mm_sub_epi8(space, empty);
+			same = _mm_sub_epi8(same, _mm_cmpeq_epi8(neighbour, types));
+			freed = _mm_or_si128(freed, empty);
+			freed = _mm_or_si128(freed, _mm_and_si128(_mm_shuffle_epi8(type_bits, neighbour), movable));
+		}
+
+	_mm_storeu_si128((__m128i *)batch.space, space);
+	_mm_storeu_si128((__m128i *)batch.diverse, _mm_sub_epi8(_mm_set1_epi8(8), same));
+	_mm_storeu_si128((__m128i *)batch.blocking, _mm_and_si128(_mm_cmpeq_epi8(freed, zero), _mm_set1_epi8(1)));
+}
+
+// New pressure of the cells from x on in row r, as solved_pressure
+static inline __m128 solved_pressure_sse41(const air_rows & rows, int r, int x) {
+	__m128 divergence = _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(rows.vx[r] + x - 1), _mm_loadu_ps(rows.vx[r] + x)),
+		_mm_sub_ps(_mm_loadu_ps(rows.vy[r - 1] + x), _mm_loadu_ps(rows.vy[r] + x)));
+	__m128 pressure = _mm_add_ps(_mm_loadu_ps(rows.pressure[r] + x), _mm_mul_ps(divergence, _mm_set1_ps(AIR_TSTEPP)));
+	return _mm_mul_ps(pressure, _mm_mul_ps(_mm_loadu_ps(rows.open[r] + x), _mm_set1_ps(AIR_PLOSS)));
+}
+
+void air_sse41(const air_rows & rows, int count) {
+	__m128 tstepv = _mm_set1_ps(AIR_TSTEPV), vloss = _mm_set1_ps(AIR_VLOSS);
+	// Same operations in the same order as solve_air_row
+	for (int x = 0; x < count; x += 4) {
+		__m128 p = solved_pressure_sse41(rows, 1, x);
+		__m128 right = solved_pressure_sse41(rows, 1, x + 1);
+		__m128 below = solved_pressure_sse41(rows, 2, x);
+		__m128 open = _mm_loadu_ps(rows.open[1] + x);
+		__m128 vx = _mm_add_ps(_mm_loadu_ps(rows.vx[1] + x), _mm_mul_ps(_mm_sub_ps(p, right), tstepv));
+		__m128 vy = _mm_add_ps(_mm_loadu_ps(rows.vy[1] + x), _mm_mul_ps(_mm_sub_ps(p, below), tstepv));
+		_mm_storeu_ps(rows.pressure_out + x, p);
+		_mm_storeu_ps(rows.vx_out + x, _mm_mul_ps(vx, _mm_mul_ps(_mm_mul_ps(open, _mm_loadu_ps(rows.open[1] + x + 1)), vloss)));
+		_mm_storeu_ps(rows.vy_out + x, _mm_mul_ps(vy, _mm_mul_ps(_mm_mul_ps(open, _mm_loadu_ps(rows.open[2] + x)), vloss)));
+	}
+}
@@ -0,0 +1,178 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <fstream>
+#include <cstring>
+#include <iterator>
+
+#include "journal.h"
+
+static_assert(sizeof(journal_header) == 64 && sizeof(journal_event) == 16, "journal layout changed");
+
+void session_journal::begin(int threads, int groups, const std::string & snapshot_) {
+	header = journal_header();
+	header.magic = JOURNAL_MAGIC;
+	header.version = JOURNAL_VERSION;
+	header.width = world_width;
+	header.height = world_height;
+	header.seed = simulation_seed;
+	header.start_step = simulation_step;
+	header.threads = threads;
+	header.groups = groups;
+	header.tile_width = tile_width;
+	header.tile_height = tile_height;
+	header.scheduler = (uint8_t)scheduler;
+	header.deterministic = deterministic;
+	header.air = air_enabled;
+	header.balance = balance_regions;
+	snapshot = snapshot_;
+	header.snapshot_length = (uint32_t)snapshot.size();
+	events.clear();
+	if (atom_engine != ENGINE_ATOMS)
+		record(JOURNAL_ENGINE, 0, 0, (uint8_t)atom_engine);
+}
+
+void session_journal::record(journal_kind kind, int x, int y, uint8_t value) {
+	journal_event event = {};
+	event.step = (uint32_t)(simulation_step - header.start_step);
+	event.x = x;
+	event.y = y;
+	event.kind = (uint8_t)kind;
+	event.value = value;
+	events.push_back(event);
+}
+
+void session_journal::record_edit(const atom_edit & edit) {
+	switch (edit.kind) {
+	case EDIT_BRUSH:
+		record(JOURNAL_ADD_PARTS, edit.rect.x + BRUSH_RADIUS, edit.rect.y + BRUSH_RADIUS, edit.type);
+		break;
+	case EDIT_FILL:
+	case EDIT_RETYPE:
+		record(edit.kind == EDIT_FILL ? JOURNAL_FILL : JOURNAL_RETYPE, edit.rect.x, edit.rect.y, edit.type);
+		record(JOURNAL_EXTENT, edit.rect.w, edit.rect.h, edit.from);
+		break;
+	}
+}
+
+bool session_journal::save(atom_field * parts, const char * path) {
+	header.end_hash = hash_atom_field(parts);
+	record(JOURNAL_END, 0, 0, 0);
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write((const char *)&header, sizeof(header));
+	file.write(snapshot.data(), snapshot.size());
+	file.write((const char *)events.data(), events.size() * sizeof(journal_event));
+	return file.good();
+}
+
+bool session_journal::load(const char * path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		*simulation_log << "journal: could not open " << path << std::endl;
+		return false;
+	}
+	std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	if (data.size() < sizeof(header)) {
+		*simulation_log << "journal: " << path << " is not a journal" << std::endl;
+		return false;
+	}
+	memcpy(&header, data.data(), sizeof(header));
+	if (header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION || header.width < 3 || header.height < 3 || header.threads < 1 || header.groups < 1) {
+		*simulation_log << "journal: " << path << " is not a journal of this version" << std::endl;
+		return false;
+	}
+
+	size_t offset = sizeof(header);
+	size_t remaining = data.size() - offset;
+	if (header.snapshot_length > remaining || (remaining - header.snapshot_length) % sizeof(journal_event)) {
+		*simulation_log << "journal: " << path << " is truncated" << std::endl;
+		return false;
+	}
+	snapshot.assign(data.data() + offset, header.snapshot_length);
+	offset += header.snapshot_length;
+	events.resize((data.size() - offset) / sizeof(journal_event));
+	memcpy(events.data(), data.data() + offset, events.size() * sizeof(journal_event));
+
+	// Steps may not go back, only the last event ends the session and every
+	// fill or retype is followed by its extent
+	for (size_t i = 0; i < events.size(); i++) {
+		bool last = i + 1 == events.size();
+		bool extent = events[i].kind == JOURNAL_EXTENT;
+		bool follows_edit = i && (events[i - 1].kind == JOURNAL_FILL || events[i - 1].kind == JOURNAL_RETYPE);
+		if ((i && events[i].step < events[i - 1].step) || (events[i].kind == JOURNAL_END) != last || events[i].kind >= JOURNAL_KIND_COUNT || extent != follows_edit || (extent && events[i].step != events[i - 1].step)) {
+			*simulation_log << "journal: " << path << " is damaged" << std::endl;
+			events.clear();
+			return false;
+		}
+	}
+	if (events.empty()) {
+		*simulation_log << "journal: " << path << " is truncated" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Saved and loaded journals end with JOURNAL_END
+uint32_t session_journal::length() const {
+	return events.size() ? events.back().step : 0;
+}
+
+void session_journal::restore_settings() const {
+	scheduler = (scheduler_mode)header.scheduler;
+	deterministic = header.deterministic != 0;
+	air_enabled = header.air != 0;
+	balance_regions = header.balance != 0;
+	atom_engine = ENGINE_ATOMS;
+	tile_width = header.tile_width;
+	tile_height = header.tile_height;
+	seed_simulation(header.seed);
+}
+
+size_t replay_events(const session_journal & journal, size_t cursor, uint32_t step, int & threads, int & groups, bool keep_pool) {
+	for (; cursor < journal.events.size() && journal.events[cursor].step <= step; cursor++) {
+		const journal_event & event = journal.events[cursor];
+		switch (event.kind) {
+		case JOURNAL_ADD_PARTS:
+			queue_edit(brush_edit(event.x, event.y, event.value));
+			break;
+		case JOURNAL_FILL:
+		case JOURNAL_RETYPE: {
+			// Load made sure the extent follows in the same step
+			const journal_event & extent = journal.events[++cursor];
+			region_bounds rect = { event.x, event.y, extent.x, extent.y };
+			queue_edit(event.kind == JOURNAL_FILL ? fill_edit(rect, event.value) : retype_edit(rect, extent.value, event.value));
+			break;
+		}
+		case JOURNAL_SCHEDULER:
+			scheduler = (scheduler_mode)event.value;
+			reinit_simulation(threads, groups);
+			break;
+		case JOURNAL_ENGINE:
+			atom_engine = (movement_engine)event.value;
+			break;
+		case JOURNAL_POOL:
+			if (keep_pool)
+				break;
+			threads = event.x;
+			groups = event.y;
+			reinit_simulation(threads, groups);
+			break;
+		}
+	}
+	return cursor;
+}
@@ -0,0 +1,88 @@
+﻿// journal.h : Records the edits of an interactive session together with the
+// step they were applied before, so the session can be replayed headlessly.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "simulation.h"
+
+// File layout, all values little endian:
+//   journal_header
+//   snapshot_length bytes of the path of the snapshot the session started from
+//   journal_event records ordered by step, the last one is JOURNAL_END
+#define JOURNAL_MAGIC 0x4A545054	// "TPTJ"
+#define JOURNAL_VERSION 1
+
+struct journal_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t width;
+	int32_t height;
+	uint64_t seed;
+	uint64_t start_step;	// simulation_step when the recording began
+	int32_t threads;
+	int32_t groups;
+	int32_t tile_width;
+	int32_t tile_height;
+	uint8_t scheduler;
+	uint8_t deterministic;
+	uint8_t air;		// air_enabled, sessions recorded before the air have 0
+	uint8_t balance;	// balance_regions, sessions recorded before strips were balanced have 0
+	uint32_t snapshot_length;	// 0 when the session started from an empty world
+	uint64_t end_hash;			// hash_atom_field when the recording ended
+};
+
+enum journal_kind {
+	JOURNAL_ADD_PARTS,	// brush edit at (x, y) with type value
+	JOURNAL_SCHEDULER,	// scheduler switched to value
+	JOURNAL_POOL,		// pool resized to x threads in y groups
+	JOURNAL_END,		// the session stopped before this step
+	JOURNAL_FILL,		// fill edit from (x, y) with type value
+	JOURNAL_RETYPE,		// retype edit from (x, y) to type value
+	JOURNAL_EXTENT,		// width and height of the edit before, for a retype the type replaced in value
+	JOURNAL_ENGINE,		// atom_engine switched to value, sessions begun with blocks start with one
+	JOURNAL_KIND_COUNT
+};
+
+struct journal_event {
+	uint32_t step;		// steps since start_step
+	int32_t x;
+	int32_t y;
+	uint8_t kind;
+	uint8_t value;
+	uint16_t padding;
+};
+
+class session_journal {
+public:
+	journal_header header;
+	std::string snapshot;
+	std::vector<journal_event> events;
+
+	// Starts a recording from the current world and settings
+	void begin(int threads, int groups, const std::string & snapshot_);
+	// Records an event applied before the next step
+	void record(journal_kind kind, int x, int y, uint8_t value);
+	// Records an edit as it is applied, see edit_applied
+	void record_edit(const atom_edit & edit);
+	// Ends the recording at the current step and writes it
+	bool save(atom_field * parts, const char * path);
+	// Returns false with the reason on simulation_log
+	bool load(const char * path);
+
+	// Steps from the start of the session to its end
+	uint32_t length() const;
+	// Seeds the simulation and applies the scheduler, balancing and air settings of the session,
+	// the engine is set back to atoms until an engine event says otherwise.
+	// A session starting past step 0 started from its snapshot, which brings
+	// back the start step when it is loaded.
+	void restore_settings() const;
+};
+
+// Queues the edits recorded before step and applies the settings changes,
+// starting at events[cursor], and returns the cursor of the first later
+// event. Pool events update threads and groups unless keep_pool is set.
+size_t replay_events(const session_journal & journal, size_t cursor, uint32_t step, int & threads, int & groups, bool keep_pool);
@@ -0,0 +1,58 @@
+﻿// mpsc_queue.h : Unbounded lock-free queue for many producers and a single
+// consumer, after Dmitry Vyukov's intrusive MPSC node queue.
+
+#pragma once
+
+#include <atomic>
+
+// A push is one atomic exchange and never waits. The consumer may miss a push
+// that is halfway done, it shows up on the next pop.
+template<typename T>
+class mpsc_queue {
+	struct node {
+		std::atomic<node *> next;
+		T value;
+	};
+
+	std::atomic<node *> head;	// last pushed, producers only
+	node * tail;				// already consumed, its successor is next
+	node stub;
+
+public:
+	mpsc_queue() : head(&stub), tail(&stub) {
+		stub.next.store(nullptr, std::memory_order_relaxed);
+	}
+
+	~mpsc_queue() {
+		T value;
+		while (pop(value));
+		if (tail != &stub)
+			delete tail;
+	}
+
+	void push(const T & value) {
+		node * pushed = new node;
+		pushed->next.store(nullptr, std::memory_order_relaxed);
+		pushed->value = value;
+		node * previous = head.exchange(pushed, std::memory_order_acq_rel);
+		previous->next.store(pushed, std::memory_order_release);
+	}
+
+	// Consumer only
+	bool pop(T & value) {
+		node * consumed = tail;
+		node * next = consumed->next.load(std::memory_order_acquire);
+		if (!next)
+			return false;
+		value = next->value;
+		tail = next;
+		if (consumed != &stub)
+			delete consumed;
+		return true;
+	}
+
+	// Consumer only
+	bool empty() const {
+		return !tail->next.load(std::memory_order_acquire);
+	}
+};
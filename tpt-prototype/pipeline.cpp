@@ -0,0 +1,210 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <algorithm>
+#include <chrono>
+
+#include "pipeline.h"
+#include "profiler.h"
+
+// Edits are queued without the mutex, so a wake racing the wait is only
+// noticed on the next poll
+#define EDIT_POLL_MS 10
+
+sim_pipeline::sim_pipeline() : parts(nullptr), running(false), paused(false), step_once(false), plane_size(0), front(0), ready(false), reading(false), pending(false) {
+	for (int i = 0; i < 2; i++) {
+		snapshots[i].type = nullptr;
+		snapshots[i].step = 0;
+		snapshots[i].stats = step_stats();
+	}
+}
+
+sim_pipeline::~sim_pipeline() {
+	stop();
+	for (int i = 0; i < 2; i++)
+		release_pages(snapshots[i].type, plane_size);
+}
+
+void sim_pipeline::start(atom_field * parts_, bool paused_) {
+	if (started())
+		return;
+
+	parts = parts_;
+	running = true;
+	paused = paused_;
+	step_once = false;
+	commands.clear();
+
+	// The world may have been resized since the last run
+	for (int i = 0; i < 2; i++)
+		release_pages(snapshots[i].type, plane_size);
+	plane_size = (size_t)world_width * world_height;
+	for (int i = 0; i < 2; i++)
+		snapshots[i].type = (uint8_t *)allocate_pages(plane_size);
+
+	// Neither buffer nor the renderer's copy is known to be current
+	stale[0].assign(chunk_columns * chunk_rows, 1);
+	stale[1].assign(chunk_columns * chunk_rows, 1);
+	changed.assign(chunk_columns * chunk_rows, 1);
+	collected.assign(chunk_columns * chunk_rows, 0);
+	ready = false;
+	reading = false;
+	pending = false;
+
+	thread = std::thread(&sim_pipeline::run, this);
+}
+
+void sim_pipeline::stop() {
+	if (!started())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		running = false;
+	}
+	condition.notify_one();
+	thread.join();
+
+	// Whatever the renderer did not acquire yet has to be drawn from the field
+	for (int i = 0; i < chunk_columns * chunk_rows; i++)
+		parts->chunks[i].dirty.store(true, std::memory_order_relaxed);
+}
+
+void sim_pipeline::pause(bool paused_) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		paused = paused_;
+	}
+	condition.notify_one();
+}
+
+void sim_pipeline::step() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		paused = true;
+		step_once = true;
+	}
+	condition.notify_one();
+}
+
+void sim_pipeline::queue(std::function<void(atom_field *)> command) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		commands.push_back(std::move(command));
+	}
+	condition.notify_one();
+}
+
+void sim_pipeline::wake() {
+	condition.notify_one();
+}
+
+void sim_pipeline::run() {
+	name_trace_thread("simulation");
+	std::vector<std::function<void(atom_field *)>> pending;
+	publish(nullptr);
+	while (true) {
+		bool simulating;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			auto woken = [this] { return !running || !paused || step_once || !commands.empty() || edits_pending(); };
+			while (!condition.wait_for(lock, std::chrono::milliseconds(EDIT_POLL_MS), woken));
+			if (!running)
+				break;
+			pending.swap(commands);
+			simulating = !paused || step_once;
+			step_once = false;
+		}
+
+		for (auto & command : pending)
+			command(parts);
+		pending.clear();
+		// Steps apply the edits themselves
+		if (!simulating)
+			apply_edits(parts);
+
+		publish(simulating ? &simulate(parts) : nullptr);
+	}
+}
+
+// Brings the back buffer up to date and swaps it to the front if the
+// renderer is not holding the front, called on the simulation thread only
+void sim_pipeline::publish(const step_stats * stats) {
+	trace_scope scope("publish");
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending = false;
+	}
+
+	collect_dirty_chunks(parts, collected);
+	for (int i = 0; i < chunk_columns * chunk_rows; i++) {
+		if (collected[i])
+			stale[0][i] = stale[1][i] = 1;
+	}
+
+	int back = 1 - front;
+	frame_snapshot & snapshot = snapshots[back];
+	for (int i = 0; i < chunk_columns * chunk_rows; i++) {
+		if (!stale[back][i])
+			continue;
+		stale[back][i] = 0;
+		region_bounds rect;
+		rect.x = (i % chunk_columns) * CHUNK_SIZE;
+		rect.y = (i / chunk_columns) * CHUNK_SIZE;
+		rect.w = std::min(CHUNK_SIZE, world_width - rect.x);
+		rect.h = std::min(CHUNK_SIZE, world_height - rect.y);
+		copy_types(parts, rect, snapshot.type);
+	}
+	snapshot.step = simulation_step;
+	snapshot.stats = stats ? *stats : snapshots[front].stats;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (int i = 0; i < chunk_columns * chunk_rows; i++) {
+		changed[i] |= collected[i];
+		collected[i] = 0;
+	}
+	if (!reading) {
+		front = back;
+		ready = true;
+	}
+	else {
+		pending = true;
+	}
+}
+
+const frame_snapshot * sim_pipeline::acquire() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!ready)
+		return nullptr;
+	ready = false;
+	reading = true;
+
+	frame_snapshot & snapshot = snapshots[front];
+	chunk_rects(changed, snapshot.rects);
+	std::fill(changed.begin(), changed.end(), 0);
+	return &snapshot;
+}
+
+void sim_pipeline::release() {
+	std::lock_guard<std::mutex> lock(mutex);
+	reading = false;
+	if (pending) {
+		front = 1 - front;
+		ready = true;
+		pending = false;
+	}
+}
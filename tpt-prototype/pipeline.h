@@ -0,0 +1,71 @@
+﻿// pipeline.h : Runs the simulation on its own thread so that the next step is
+// computed while the render side draws a snapshot of the previous one.
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "simulation.h"
+
+// Copy of the type plane after a step along with the statistics of that step
+struct frame_snapshot {
+	uint8_t * type;
+	uint64_t step;
+	step_stats stats;
+	std::vector<region_bounds> rects;	// chunks changed since the previous acquire
+};
+
+// The simulation thread owns the atom field while the pipeline runs, edits
+// have to go through queue_edit and anything else through queue. Snapshots are double buffered: the simulation copies the
+// chunks that changed into the back buffer after every step and swaps it to
+// the front unless the renderer still holds the front, in which case the swap
+// happens on release instead of the simulation waiting.
+class sim_pipeline {
+	atom_field * parts;
+	std::thread thread;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool running;
+	bool paused;
+	bool step_once;
+	std::vector<std::function<void(atom_field *)>> commands;
+
+	frame_snapshot snapshots[2];
+	size_t plane_size;	// bytes of each type plane, backed by huge pages where possible
+	std::vector<uint8_t> stale[2];	// chunks each buffer lags behind in
+	std::vector<uint8_t> changed;	// chunks changed since the renderer last acquired
+	std::vector<uint8_t> collected;
+	int front;
+	bool ready;
+	bool reading;
+	bool pending;	// the back buffer is complete but could not be swapped yet
+
+	void run();
+	void publish(const step_stats * stats);
+public:
+	sim_pipeline();
+	~sim_pipeline();
+	bool started() const { return thread.joinable(); }
+	void start(atom_field * parts_, bool paused_);
+	// Joins the simulation thread and marks every chunk dirty, the caller owns the field again
+	void stop();
+
+	void pause(bool paused_);
+	// Runs a single step and pauses
+	void step();
+	// Runs on the simulation thread before the next step
+	void queue(std::function<void(atom_field *)> command);
+	// Has a paused simulation thread pick up queued edits, never blocks
+	void wake();
+
+	// Latest snapshot not acquired yet, or nullptr. Has to be released
+	// before the simulation can publish the next one.
+	const frame_snapshot * acquire();
+	void release();
+};
@@ -0,0 +1,286 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdint>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "placement.h"
+
+bool huge_pages = true;
+
+namespace {
+
+// Cores the process may use, taken once before anything is pinned
+struct cpu_topology {
+	std::vector<int> cores;
+	std::vector<int> core_nodes;	// node of every core id, indexed by core
+	int node_count = 1;
+};
+
+#ifdef __linux__
+// Parses a sysfs list like "0-3,8-11"
+std::vector<int> parse_core_list(const std::string & text) {
+	std::vector<int> cores;
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		if (item.empty() || item == "\n")
+			continue;
+		size_t dash = item.find('-');
+		int first = std::stoi(item.substr(0, dash));
+		int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+		for (int core = first; core <= last; core++)
+			cores.push_back(core);
+	}
+	return cores;
+}
+#endif
+
+cpu_topology detect_topology() {
+	cpu_topology topology;
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		for (int core = 0; core < CPU_SETSIZE; core++)
+			if (CPU_ISSET(core, &allowed))
+				topology.cores.push_back(core);
+	}
+	for (int node = 0; ; node++) {
+		std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		std::string list;
+		if (!file || !std::getline(file, list))
+			break;
+		for (int core : parse_core_list(list)) {
+			if (core >= (int)topology.core_nodes.size())
+				topology.core_nodes.resize(core + 1, 0);
+			topology.core_nodes[core] = node;
+		}
+		topology.node_count = node + 1;
+	}
+#elif defined(_WIN32)
+	DWORD_PTR process_mask, system_mask;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+		for (int core = 0; core < (int)sizeof(DWORD_PTR) * 8; core++)
+			if (process_mask & ((DWORD_PTR)1 << core))
+				topology.cores.push_back(core);
+	}
+	ULONG highest_node = 0;
+	if (GetNumaHighestNodeNumber(&highest_node))
+		topology.node_count = (int)highest_node + 1;
+	for (int core : topology.cores) {
+		UCHAR node = 0;
+		if (core >= (int)topology.core_nodes.size())
+			topology.core_nodes.resize(core + 1, 0);
+		if (GetNumaProcessorNode((UCHAR)core, &node) && node != 0xFF)
+			topology.core_nodes[core] = node;
+	}
+#endif
+	if (topology.cores.empty())
+		topology.cores.push_back(0);
+	topology.core_nodes.resize(std::max((int)topology.core_nodes.size(), topology.cores.back() + 1), 0);
+	return topology;
+}
+
+const cpu_topology & topology() {
+	static cpu_topology detected = detect_topology();
+	return detected;
+}
+
+size_t huge_page_round(size_t size) {
+	return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+}
+
+pin_mode parse_pinning(const std::string & text, std::vector<int> & cores) {
+	cores.clear();
+	if (text == "none")
+		return PIN_NONE;
+	if (text == "compact")
+		return PIN_COMPACT;
+	if (text == "scatter")
+		return PIN_SCATTER;
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ','))
+		cores.push_back(std::stoi(item));
+	if (cores.empty())
+		throw std::invalid_argument(text);
+	return PIN_CORES;
+}
+
+std::vector<int> pin_cores(pin_mode mode, const std::vector<int> & cores, int participants) {
+	const cpu_topology & system = topology();
+	std::vector<int> order;
+	if (mode == PIN_CORES) {
+		order = cores;
+	}
+	else if (mode == PIN_COMPACT) {
+		order = system.cores;
+		std::stable_sort(order.begin(), order.end(), [&system](int a, int b) {
+			return system.core_nodes[a] < system.core_nodes[b];
+		});
+	}
+	else if (mode == PIN_SCATTER) {
+		std::vector<std::vector<int>> nodes(system.node_count);
+		for (int core : system.cores)
+			nodes[system.core_nodes[core]].push_back(core);
+		for (size_t i = 0; order.size() < system.cores.size(); i++)
+			for (auto & node : nodes)
+				if (i < node.size())
+					order.push_back(node[i]);
+	}
+
+	std::vector<int> assigned;
+	for (int i = 0; i < participants && order.size(); i++)
+		assigned.push_back(order[i % order.size()]);
+	return assigned;
+}
+
+bool pin_thread(int core) {
+	const cpu_topology & system = topology();
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (core >= 0 && core < CPU_SETSIZE) {
+		CPU_SET(core, &set);
+	}
+	else {
+		for (int allowed : system.cores)
+			CPU_SET(allowed, &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+	DWORD_PTR mask = 0;
+	if (core >= 0 && core < (int)sizeof(DWORD_PTR) * 8) {
+		mask = (DWORD_PTR)1 << core;
+	}
+	else {
+		for (int allowed : system.cores)
+			mask |= (DWORD_PTR)1 << allowed;
+	}
+	return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+	return false;
+#endif
+}
+
+int numa_node_count() {
+	return topology().node_count;
+}
+
+int current_numa_node() {
+	const cpu_topology & system = topology();
+	if (system.node_count == 1)
+		return 0;
+#ifdef __linux__
+	int core = sched_getcpu();
+#elif defined(_WIN32)
+	int core = (int)GetCurrentProcessorNumber();
+#else
+	int core = -1;
+#endif
+	if (core < 0 || core >= (int)system.core_nodes.size())
+		return 0;
+	return system.core_nodes[core];
+}
+
+void * allocate_pages(size_t size, page_backing * backing) {
+	size = huge_page_round(size);
+	page_backing used = BACKING_SMALL;
+	void * memory = nullptr;
+#ifdef _WIN32
+	// Large pages need the lock pages privilege, without it this fails and normal pages are used
+	SIZE_T large = GetLargePageMinimum();
+	if (huge_pages && large && size % large == 0) {
+		memory = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		used = BACKING_HUGE;
+	}
+	if (!memory) {
+		memory = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		used = BACKING_SMALL;
+	}
+	if (!memory)
+		throw std::bad_alloc();
+#else
+#ifdef MAP_HUGETLB
+	if (huge_pages) {
+		memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (memory == MAP_FAILED)
+			memory = nullptr;
+		else
+			used = BACKING_HUGE;
+	}
+#endif
+	if (!memory) {
+		// Mapped one huge page larger so that the start can be aligned to one
+		char * mapped = (char *)mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapped == MAP_FAILED)
+			throw std::bad_alloc();
+		char * aligned = (char *)(((uintptr_t)mapped + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+		if (aligned != mapped)
+			munmap(mapped, aligned - mapped);
+		if (aligned + size != mapped + size + HUGE_PAGE_SIZE)
+			munmap(aligned + size, mapped + HUGE_PAGE_SIZE - aligned);
+		memory = aligned;
+#ifdef MADV_HUGEPAGE
+		if (huge_pages && madvise(memory, size, MADV_HUGEPAGE) == 0)
+			used = BACKING_TRANSPARENT;
+#endif
+	}
+#endif
+	if (backing)
+		*backing = used;
+	return memory;
+}
+
+void release_pages(void * memory, size_t size) {
+	if (!memory)
+		return;
+#ifdef _WIN32
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, huge_page_round(size));
+#endif
+}
+
+const char * page_backing_name(page_backing backing) {
+	switch (backing) {
+	case BACKING_HUGE:
+		return "huge pages";
+	case BACKING_TRANSPARENT:
+		return "transparent huge pages";
+	default:
+		return "normal pages";
+	}
+}
@@ -0,0 +1,50 @@
+﻿// placement.h : Where the simulation threads run and where its memory lives.
+// Participants can be pinned to cores, NUMA nodes are detected so that memory
+// is handed out on the node of the thread asking for it, and large
+// allocations are backed by huge pages where the system has them.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+enum pin_mode {
+	PIN_NONE,		// threads run wherever the system puts them
+	PIN_COMPACT,	// participant i gets the i-th core, filling one node before the next
+	PIN_SCATTER,	// participants go round robin over the nodes
+	PIN_CORES		// participant i gets cores[i % cores.size()]
+};
+
+// Parses none, compact, scatter or a comma separated core list, throws std::invalid_argument
+pin_mode parse_pinning(const std::string & text, std::vector<int> & cores);
+
+// Core of every participant, empty for PIN_NONE. Only the cores the process
+// was allowed to run on at startup are handed out.
+std::vector<int> pin_cores(pin_mode mode, const std::vector<int> & cores, int participants);
+// Pins the calling thread to a core, a negative core lets it run on any
+// allowed core again. False where affinity is not supported.
+bool pin_thread(int core);
+
+int numa_node_count();
+// Node of the core the calling thread runs on right now, 0 where unknown
+int current_numa_node();
+
+// Huge pages are 2 MiB on the platforms we run on
+#define HUGE_PAGE_SIZE (2 << 20)
+
+enum page_backing {
+	BACKING_HUGE,			// explicit huge pages reserved by the system
+	BACKING_TRANSPARENT,	// normal pages the kernel may merge into huge ones
+	BACKING_SMALL
+};
+
+// Tries explicit huge pages, then transparent ones, then normal pages
+extern bool huge_pages;
+
+// Zeroed memory rounded up to whole huge pages and aligned to one. None of it
+// is touched, every page lands on the node of the first thread writing to it.
+void * allocate_pages(size_t size, page_backing * backing = nullptr);
+// size as given to allocate_pages
+void release_pages(void * memory, size_t size);
+const char * page_backing_name(page_backing backing);
@@ -0,0 +1,295 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <fstream>
+#include <iomanip>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "profiler.h"
+
+struct trace_event {
+	const char * name;
+	int64_t arg;
+	int64_t start_ns;
+	int64_t duration_ns;
+	bool counted;
+	uint64_t counters[COUNTER_COUNT];
+};
+
+// Only the owning thread writes a ring, it outlives the thread and is handed
+// to the next thread that starts tracing
+struct trace_ring {
+	std::vector<trace_event> events;
+	uint64_t written = 0;
+	int id = 0;
+	std::string name;
+	bool owned = true;
+	int counter_fds[COUNTER_COUNT] = { -1, -1, -1 };	// the first leads the group, open from the first counted scope
+	bool counters_failed = false;
+};
+
+std::atomic<bool> tracing(false);
+
+namespace {
+
+std::mutex rings_mutex;
+std::vector<std::unique_ptr<trace_ring>> rings;
+std::chrono::steady_clock::time_point trace_epoch;
+bool counters_wanted = false;
+
+int64_t trace_ns(std::chrono::steady_clock::time_point time) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(time - trace_epoch).count();
+}
+
+#ifdef __linux__
+int open_counter(uint64_t type, uint64_t config, int group) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = (uint32_t)type;
+	attr.config = config;
+	attr.disabled = group == -1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+void close_counters(trace_ring * ring) {
+	for (int i = COUNTER_COUNT - 1; i >= 0; i--) {
+		if (ring->counter_fds[i] >= 0)
+			close(ring->counter_fds[i]);
+		ring->counter_fds[i] = -1;
+	}
+}
+
+// Opens the counters of the calling thread as one group, read in one go
+bool open_counters(trace_ring * ring) {
+	static const uint64_t configs[COUNTER_COUNT] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		ring->counter_fds[i] = open_counter(PERF_TYPE_HARDWARE, configs[i], i ? ring->counter_fds[0] : -1);
+		if (ring->counter_fds[i] < 0) {
+			close_counters(ring);
+			return false;
+		}
+	}
+	if (ioctl(ring->counter_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0) {
+		close_counters(ring);
+		return false;
+	}
+	return true;
+}
+
+bool read_counters(trace_ring * ring, uint64_t * counters) {
+	uint64_t values[1 + COUNTER_COUNT];
+	if (read(ring->counter_fds[0], values, sizeof(values)) != (ssize_t)sizeof(values))
+		return false;
+	memcpy(counters, values + 1, sizeof(uint64_t) * COUNTER_COUNT);
+	return true;
+}
+#endif
+
+// Gives the ring back when the thread exits
+struct ring_owner {
+	trace_ring * ring = nullptr;
+	std::string name;
+	~ring_owner() {
+		if (ring) {
+			std::lock_guard<std::mutex> lock(rings_mutex);
+#ifdef __linux__
+			close_counters(ring);
+#endif
+			ring->owned = false;
+		}
+	}
+};
+
+thread_local ring_owner owner;
+
+trace_ring * thread_ring() {
+	if (owner.ring)
+		return owner.ring;
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	for (auto & ring : rings) {
+		if (!ring->owned) {
+			owner.ring = ring.get();
+			break;
+		}
+	}
+	if (!owner.ring) {
+		rings.emplace_back(new trace_ring());
+		owner.ring = rings.back().get();
+		owner.ring->id = (int)rings.size();
+		owner.ring->events.resize(TRACE_RING_EVENTS);
+	}
+	owner.ring->owned = true;
+	owner.ring->name = owner.name;
+	return owner.ring;
+}
+
+trace_event & next_event(trace_ring * ring) {
+	return ring->events[ring->written++ % TRACE_RING_EVENTS];
+}
+
+// Counters of the calling thread, false while they are off or unavailable
+bool thread_counters(trace_ring * ring, uint64_t * counters) {
+#ifdef __linux__
+	if (!counters_wanted || ring->counters_failed)
+		return false;
+	if (ring->counter_fds[0] < 0 && !open_counters(ring)) {
+		ring->counters_failed = true;
+		return false;
+	}
+	return read_counters(ring, counters);
+#else
+	return false;
+#endif
+}
+
+// Only while tracing is off, the threads open them again as they need them
+void reset_counters() {
+	for (auto & ring : rings) {
+#ifdef __linux__
+		close_counters(ring.get());
+#endif
+		ring->counters_failed = false;
+	}
+}
+
+}
+
+bool start_tracing(bool counters) {
+	stop_tracing();
+	{
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		reset_counters();
+		for (auto & ring : rings)
+			ring->written = 0;
+		trace_epoch = std::chrono::steady_clock::now();
+		counters_wanted = counters;
+	}
+
+	// Tried on the calling thread first so that an unavailable counter is reported once
+	bool available = true;
+	if (counters) {
+		uint64_t values[COUNTER_COUNT];
+		available = thread_counters(thread_ring(), values);
+		counters_wanted = available;
+	}
+	tracing.store(true, std::memory_order_release);
+	return available;
+}
+
+void stop_tracing() {
+	tracing.store(false, std::memory_order_release);
+}
+
+void name_trace_thread(const std::string & name) {
+	owner.name = name;
+	if (owner.ring) {
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		owner.ring->name = name;
+	}
+}
+
+void trace_complete(const char * name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, int64_t arg) {
+	if (!tracing.load(std::memory_order_relaxed))
+		return;
+	trace_event & event = next_event(thread_ring());
+	event.name = name;
+	event.arg = arg;
+	event.start_ns = trace_ns(start);
+	event.duration_ns = trace_ns(end) - event.start_ns;
+	event.counted = false;
+}
+
+void trace_scope::begin(bool counted) {
+	ring = thread_ring();
+	if (!counted || !thread_counters(ring, counters))
+		counters[0] = UINT64_MAX;
+	start = std::chrono::steady_clock::now();
+}
+
+void trace_scope::end() {
+	std::chrono::steady_clock::time_point finish = std::chrono::steady_clock::now();
+	trace_event & event = next_event(ring);
+	event.name = name;
+	event.arg = arg;
+	event.start_ns = trace_ns(start);
+	event.duration_ns = trace_ns(finish) - event.start_ns;
+	event.counted = false;
+	if (counters[0] != UINT64_MAX && thread_counters(ring, event.counters)) {
+		event.counted = true;
+		for (int i = 0; i < COUNTER_COUNT; i++)
+			event.counters[i] -= counters[i];
+	}
+}
+
+bool write_trace(const char * path) {
+	static const char * counter_names[COUNTER_COUNT] = { "cycles", "llc_misses", "branch_misses" };
+
+	std::ofstream out(path);
+	if (!out)
+		return false;
+
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+	out << std::fixed << std::setprecision(3);
+	bool first = true;
+	for (auto & ring : rings) {
+		if (!ring->written)
+			continue;
+		std::string name = ring->name.size() ? ring->name : "thread " + std::to_string(ring->id);
+		out << (first ? "" : ",\n") << "\t{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << ring->id << ", \"args\": {\"name\": \"" << name << "\"}}";
+		first = false;
+
+		uint64_t begin = ring->written > TRACE_RING_EVENTS ? ring->written - TRACE_RING_EVENTS : 0;
+		for (uint64_t i = begin; i < ring->written; i++) {
+			const trace_event & event = ring->events[i % TRACE_RING_EVENTS];
+			out << ",\n\t{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << ring->id
+				<< ", \"ts\": " << event.start_ns / 1000.0 << ", \"dur\": " << event.duration_ns / 1000.0;
+			if (event.arg >= 0 || event.counted) {
+				out << ", \"args\": {";
+				const char * separator = "";
+				if (event.arg >= 0) {
+					out << "\"index\": " << event.arg;
+					separator = ", ";
+				}
+				if (event.counted) {
+					for (int c = 0; c < COUNTER_COUNT; c++) {
+						out << separator << "\"" << counter_names[c] << "\": " << event.counters[c];
+						separator = ", ";
+					}
+				}
+				out << "}";
+			}
+			out << "}";
+		}
+	}
+	out << std::endl << "]}" << std::endl;
+	return (bool)out;
+}
@@ -0,0 +1,66 @@
+﻿// profiler.h : Opt-in tracing of the steps. Scopes are recorded into a ring
+// per thread and written out as Chrome trace events, which chrome://tracing
+// and Perfetto open. On Linux counted scopes also read the cycles, last level
+// cache misses and branch misses of their thread through perf_event_open.
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Each thread keeps its latest events, older ones are overwritten
+#define TRACE_RING_EVENTS 16384
+
+enum trace_counter {
+	COUNTER_CYCLES,
+	COUNTER_LLC_MISSES,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_COUNT
+};
+
+extern std::atomic<bool> tracing;
+
+// Starts recording and drops the events recorded so far, only between steps.
+// With counters the counted scopes also read the hardware counters, false if
+// the kernel does not allow that, in which case the events are recorded
+// without them.
+bool start_tracing(bool counters);
+void stop_tracing();
+// Writes the recorded events as Chrome trace JSON, only once tracing stopped
+// and no step is running
+bool write_trace(const char * path);
+
+// Name the events of the calling thread are listed under
+void name_trace_thread(const std::string & name);
+
+// Records an event that was timed by the caller
+void trace_complete(const char * name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, int64_t arg = -1);
+
+struct trace_ring;
+
+// Records the time from construction to destruction on the calling thread.
+// name has to outlive the trace, arg is shown with the event unless negative.
+// Costs a relaxed load while tracing is off.
+class trace_scope {
+	const char * name;
+	int64_t arg;
+	trace_ring * ring;
+	std::chrono::steady_clock::time_point start;
+	uint64_t counters[COUNTER_COUNT];
+
+	void begin(bool counted);
+	void end();
+public:
+	trace_scope(const char * name_, int64_t arg_ = -1, bool counted = false) : name(name_), arg(arg_), ring(nullptr) {
+		if (tracing.load(std::memory_order_relaxed))
+			begin(counted);
+	}
+	~trace_scope() {
+		if (ring)
+			end();
+	}
+	trace_scope(const trace_scope &) = delete;
+	trace_scope & operator=(const trace_scope &) = delete;
+};
@@ -0,0 +1,40 @@
+﻿// rng.h : Counter based random numbers. A stream is derived from the seed,
+// the step and the cell being updated, so the numbers a cell sees do not
+// depend on which thread processes it or in which order.
+
+#pragma once
+
+#include <cstdint>
+
+// SplitMix64 finaliser
+inline uint64_t rng_mix(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+inline uint64_t rng_step_key(uint64_t seed, uint64_t step) {
+	return rng_mix(seed ^ rng_mix(step + 0x9E3779B97F4A7C15ULL));
+}
+
+struct rng_stream {
+	uint64_t state;
+
+	rng_stream(uint64_t step_key, int x, int y) : state(step_key ^ ((((uint64_t)(uint32_t)y << 32) | (uint32_t)x) * 0xD1B54A32D192ED03ULL)) {
+	}
+
+	uint64_t next() {
+		state += 0x9E3779B97F4A7C15ULL;
+		return rng_mix(state);
+	}
+};
+
+// Uniform in [-1, 1)
+inline float randfd(rng_stream & rng) {
+	return (rng.next() >> 40) * (1.0f / 8388608.0f) - 1.0f;
+}
+
+// -1 or 1
+inline int randd(rng_stream & rng) {
+	return (int)(rng.next() >> 63) * 2 - 1;
+}
@@ -0,0 +1,1773 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <chrono>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <vector>
+#include <map>
+#include <mutex>
+#include <new>
+#include <memory>
+
+#include "simulation.h"
+#include "thread_pool.h"
+#include "task_graph.h"
+#include "rng.h"
+#include "integrate.h"
+#include "elements.h"
+#include "blocks.h"
+#include "mpsc_queue.h"
+#include "profiler.h"
+
+// Atoms moving at least ISTP cells per step sweep their path
+#define ISTP 1
+#define COLLISIONLOSS 0.1f
+
+#define CHUNK_SLEEP_STEPS 16
+
+inline bool get_mutex(atom_field * parts, int x, int y) {
+	return (parts->mutex[BIT(x, y)].load(std::memory_order_relaxed) >> (x & 63)) & 1;
+}
+
+// Neighbouring regions can share a bitplane word, so updates have to be atomic
+inline void set_mutex(atom_field * parts, int x, int y, bool value) {
+	if (value)
+		parts->mutex[BIT(x, y)].fetch_or(uint64_t(1) << (x & 63), std::memory_order_relaxed);
+	else
+		parts->mutex[BIT(x, y)].fetch_and(~(uint64_t(1) << (x & 63)), std::memory_order_relaxed);
+}
+
+// Occupancy mirrors type != TYPE_NONE, it is shared the same way as the processed flags
+inline void set_occupied(atom_field * parts, int x, int y, bool value) {
+	if (value)
+		parts->occupied[BIT(x, y)].fetch_or(uint64_t(1) << (x & 63), std::memory_order_relaxed);
+	else
+		parts->occupied[BIT(x, y)].fetch_and(~(uint64_t(1) << (x & 63)), std::memory_order_relaxed);
+}
+
+// First occupied cell of row y in [x, end), end if there is none
+inline int next_occupied(atom_field * parts, int x, int end, int y) {
+	while (x < end) {
+		uint64_t bits = parts->occupied[BIT(x, y)].load(std::memory_order_relaxed) >> (x & 63);
+		if (bits)
+			return std::min(x + count_trailing_zeros(bits), end);
+		x = (x | 63) + 1;
+	}
+	return end;
+}
+
+// Hash of every occupied cell, used to check that runs are reproducible
+uint64_t hash_atom_field(atom_field * parts) {
+	uint64_t hash = 0;
+	for (int y = 0; y < world_height; y++) {
+		for (int x = 0; x < world_width; x++) {
+			const atom_page * page = page_at(parts, x, y);
+			if (page == &empty_page) {
+				x |= CHUNK_SIZE - 1;
+				continue;
+			}
+			int c = CELL(x, y);
+			if (page->type[c] == TYPE_NONE)
+				continue;
+			uint64_t i = (uint64_t)y * world_width + x;
+			float values[4] = { load_velocity(page->vx[c]), load_velocity(page->vy[c]), load_position(page->x[c], x), load_position(page->y[c], y) };
+			uint32_t bits[4];
+			memcpy(bits, values, sizeof(bits));
+			hash = rng_mix(hash ^ ((i << 8) | page->type[c]));
+			hash = rng_mix(hash ^ (((uint64_t)bits[0] << 32) | bits[1]));
+			hash = rng_mix(hash ^ (((uint64_t)bits[2] << 32) | bits[3]));
+		}
+	}
+	return hash;
+}
+
+// Keep every chunk touching the inclusive rectangle awake for the next step
+void wake_chunk_rect(atom_field * parts, int x0, int y0, int x1, int y1) {
+	x0 = std::max(x0, 0);
+	y0 = std::max(y0, 0);
+	x1 = std::min(x1, world_width - 1);
+	y1 = std::min(y1, world_height - 1);
+	for (int chunk_y = y0 / CHUNK_SIZE; chunk_y <= y1 / CHUNK_SIZE; chunk_y++)
+		for (int chunk_x = x0 / CHUNK_SIZE; chunk_x <= x1 / CHUNK_SIZE; chunk_x++) {
+			std::atomic<bool> & active = parts->chunks[chunk_x + chunk_y * chunk_columns].active;
+			if (!active.load(std::memory_order_relaxed))
+				active.store(true, std::memory_order_relaxed);
+		}
+}
+
+inline void wake_chunks(atom_field * parts, int x, int y) {
+	wake_chunk_rect(parts, x - 1, y - 1, x + 1, y + 1);
+}
+
+// The type of a cell changed, its chunk has to be uploaded again
+inline void mark_dirty(atom_field * parts, int x, int y) {
+	std::atomic<bool> & dirty = parts->chunks[CHUNK(x, y)].dirty;
+	if (!dirty.load(std::memory_order_relaxed))
+		dirty.store(true, std::memory_order_relaxed);
+}
+
+// Slabs are only returned to the system once empty and not the last one of
+// their node with free pages, so a chunk emptying and filling up again along
+// a slab boundary does not map and unmap it every step
+struct page_slab {
+	char * memory;
+	int node;
+	std::vector<atom_page *> free;
+};
+
+#define SLAB_PAGES (PAGE_SLAB_SIZE / sizeof(atom_page))
+
+std::mutex slab_mutex;
+std::map<uintptr_t, page_slab *> slabs;			// by address, to find the slab of a page
+std::vector<std::vector<page_slab *>> open_slabs;	// slabs with free pages, by node
+bool slab_backing_logged = false;
+
+// Zeroed on the calling thread, which places the page on its node
+atom_page * allocate_page() {
+	int node = current_numa_node();
+	atom_page * page;
+	{
+		std::lock_guard<std::mutex> lock(slab_mutex);
+		if ((int)open_slabs.size() <= node)
+			open_slabs.resize(node + 1);
+		std::vector<page_slab *> & open = open_slabs[node];
+		if (open.empty()) {
+			page_backing backing;
+			page_slab * slab = new page_slab;
+			slab->memory = (char *)allocate_pages(PAGE_SLAB_SIZE, &backing);
+			slab->node = node;
+			for (int i = SLAB_PAGES - 1; i >= 0; i--)
+				slab->free.push_back((atom_page *)(slab->memory + i * sizeof(atom_page)));
+			slabs[(uintptr_t)slab->memory] = slab;
+			open.push_back(slab);
+			if (!slab_backing_logged) {
+				*simulation_log << "atom pages backed by " << page_backing_name(backing) << " on " << numa_node_count() << " node(s)." << std::endl;
+				slab_backing_logged = true;
+			}
+		}
+		page_slab * slab = open.back();
+		page = slab->free.back();
+		slab->free.pop_back();
+		if (slab->free.empty())
+			open.pop_back();
+	}
+	return new (page) atom_page();
+}
+
+void release_page(atom_page * page) {
+	std::lock_guard<std::mutex> lock(slab_mutex);
+	auto found = --slabs.upper_bound((uintptr_t)page);
+	page_slab * slab = found->second;
+	std::vector<page_slab *> & open = open_slabs[slab->node];
+	if (slab->free.empty())
+		open.push_back(slab);
+	slab->free.push_back(page);
+	if (slab->free.size() == SLAB_PAGES && open.size() > 1) {
+		open.erase(std::find(open.begin(), open.end(), slab));
+		release_pages(slab->memory, PAGE_SLAB_SIZE);
+		slabs.erase(found);
+		delete slab;
+	}
+}
+
+// Unmaps the slabs kept around after their last page was released
+void release_empty_slabs() {
+	std::lock_guard<std::mutex> lock(slab_mutex);
+	for (auto & open : open_slabs) {
+		for (auto slab = open.begin(); slab != open.end(); ) {
+			if ((*slab)->free.size() != SLAB_PAGES) {
+				++slab;
+				continue;
+			}
+			release_pages((*slab)->memory, PAGE_SLAB_SIZE);
+			slabs.erase((uintptr_t)(*slab)->memory);
+			delete *slab;
+			slab = open.erase(slab);
+		}
+	}
+}
+
+// Page of the chunk holding (x, y), allocated on the first write. When two
+// participants race for the same chunk the page installed first is kept.
+atom_page * writable_page(atom_field * parts, int x, int y) {
+	std::atomic<atom_page *> & entry = parts->pages[CHUNK(x, y)];
+	atom_page * page = entry.load(std::memory_order_acquire);
+	if (page != &empty_page)
+		return page;
+
+	atom_page * created = allocate_page();
+	if (entry.compare_exchange_strong(page, created, std::memory_order_acq_rel, std::memory_order_acquire)) {
+		parts->pagecount.fetch_add(1, std::memory_order_relaxed);
+		return created;
+	}
+	release_page(created);
+	return page;
+}
+
+// Only called between steps, nothing may hold on to the page
+void free_page(atom_field * parts, int chunk) {
+	atom_page * page = parts->pages[chunk].exchange(&empty_page, std::memory_order_acq_rel);
+	if (page != &empty_page) {
+		release_page(page);
+		parts->pagecount.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+// No row of the chunk has an occupied bit
+bool chunk_empty(atom_field * parts, int chunk) {
+	int x = (chunk % chunk_columns) * CHUNK_SIZE;
+	int y0 = (chunk / chunk_columns) * CHUNK_SIZE;
+	int y1 = std::min(y0 + CHUNK_SIZE, world_height);
+	uint64_t mask = (~uint64_t(0) >> (64 - CHUNK_SIZE)) << (x & 63);
+	for (int y = y0; y < y1; y++) {
+		if (parts->occupied[BIT(x, y)].load(std::memory_order_relaxed) & mask)
+			return false;
+	}
+	return true;
+}
+
+// Copies count types of row y from x on, cells outside the world read as empty
+inline void copy_row(const atom_field * parts, int x, int y, int count, uint8_t * dest) {
+	while (count > 0) {
+		if (x < 0 || x >= world_width) {
+			*dest++ = TYPE_NONE;
+			x++;
+			count--;
+			continue;
+		}
+		int run = std::min(std::min(count, CHUNK_SIZE - (x & (CHUNK_SIZE - 1))), world_width - x);
+		memcpy(dest, page_at(parts, x, y)->type + CELL(x, y), run);
+		dest += run;
+		x += run;
+		count -= run;
+	}
+}
+
+// Rows of neighbours gathered from two pages, the copies are a fixed
+// CHUNK_SIZE bytes so they stay a couple of vector moves
+#define WINDOW_SIZE (2 * CHUNK_SIZE)
+typedef uint8_t neighbour_window[3][WINDOW_SIZE];
+
+// Points rows at the neighbour rows of cells x to x + width - 1 of row y,
+// which lie in page. Rows reaching past the page are gathered into window.
+inline void gather_rows(const atom_field * parts, const atom_page * page, int x, int y, int width, neighbour_window & window, neighbour_rows & rows) {
+	int left = x - 1;
+	int split = (left | (CHUNK_SIZE - 1)) + 1;
+	bool inside = left >= 0 && x + width < split;
+	bool edge = left < 0 || (!inside && split >= world_width);
+	for (int r = 0; r < 3; r++) {
+		int row_y = y + r - 1;
+		const atom_page * row_page = (row_y & ~(CHUNK_SIZE - 1)) == (y & ~(CHUNK_SIZE - 1)) && left >= (x & ~(CHUNK_SIZE - 1)) ? page : page_at(parts, left, row_y);
+		if (inside) {
+			rows[r] = row_page->type + CELL(x, row_y);
+			continue;
+		}
+		if (edge)
+			copy_row(parts, left, row_y, width + 2, window[r]);
+		else {
+			memcpy(window[r], row_page->type + CELL(left, row_y), CHUNK_SIZE);
+			memcpy(window[r] + (split - left), page_at(parts, split, row_y)->type + CELL(split, row_y), CHUNK_SIZE);
+		}
+		rows[r] = window[r] + 1;
+	}
+}
+
+// Moves the atom of type TYPE at (x, y)
+template<int TYPE>
+bool do_move(atom_field * parts, thread_stats & stats, int x, int y, float resultx, float resulty) {
+	atom_page * page = page_at(parts, x, y);
+	int current = CELL(x, y);
+	int resultx_quant = PART_POS_QUANT(resultx);
+	int resulty_quant = PART_POS_QUANT(resulty);
+	if (resultx_quant < 0 || resultx_quant >= world_width || resulty_quant < 0 || resulty_quant >= world_height) {
+		page->type[current] = TYPE_NONE;
+		set_occupied(parts, x, y, false);
+		mark_dirty(parts, x, y);
+		wake_chunks(parts, x, y);
+		stats.moves++;
+		return true;
+	}
+
+	atom_page * target_page = page_at(parts, resultx_quant, resulty_quant);
+	int target = CELL(resultx_quant, resulty_quant);
+
+	if (displaces(TYPE, target_page->type[target])) {
+		if (target_page == &empty_page)
+			target_page = writable_page(parts, resultx_quant, resulty_quant);
+		if (target_page->type[target] == TYPE_NONE) {
+			set_occupied(parts, x, y, false);
+			set_occupied(parts, resultx_quant, resulty_quant, true);
+		}
+		if (target_page->type[target] != TYPE) {
+			mark_dirty(parts, x, y);
+			mark_dirty(parts, resultx_quant, resulty_quant);
+		}
+		std::swap(page->type[current], target_page->type[target]);
+		std::swap(page->vx[current], target_page->vx[target]);
+		std::swap(page->vy[current], target_page->vy[target]);
+		// The displaced atom keeps the position of the cell it was moved into
+		target_page->x[target] = store_position(resultx, resultx_quant);
+		target_page->y[target] = store_position(resulty, resulty_quant);
+		bool current_mutex = get_mutex(parts, x, y);
+		set_mutex(parts, x, y, get_mutex(parts, resultx_quant, resulty_quant));
+		set_mutex(parts, resultx_quant, resulty_quant, current_mutex);
+		wake_chunks(parts, x, y);
+		wake_chunks(parts, resultx_quant, resulty_quant);
+		stats.moves++;
+		return true;
+	}
+	else {
+		stats.failed_moves++;
+		return false;
+	}
+}
+
+std::ostream * simulation_log = &std::cout;
+
+scheduler_mode scheduler = SCHEDULER_STRIPS;
+pin_mode thread_pinning = PIN_NONE;
+std::vector<int> pinned_cores;
+int tile_width = 64;
+int tile_height = 64;
+
+float move_limit = FLT_MAX;
+
+int band_y0 = 0;
+int band_y1 = SIMULATIONH;
+void (*tile_colour_done)(atom_field * parts, int colour) = nullptr;
+void (*air_pushes_done)(atom_field * parts) = nullptr;
+
+bool air_enabled = true;
+
+movement_engine atom_engine = ENGINE_ATOMS;
+// Types the atom pass leaves to the block pass this step
+uint8_t block_types = 0;
+
+uint64_t simulation_seed = 0;
+uint64_t simulation_step = 0;
+uint64_t step_key = rng_step_key(0, 0);
+bool deterministic = false;
+
+int world_width = SIMULATIONW;
+int world_height = SIMULATIONH;
+int chunk_columns = (SIMULATIONW + CHUNK_SIZE - 1) / CHUNK_SIZE;
+int chunk_rows = (SIMULATIONH + CHUNK_SIZE - 1) / CHUNK_SIZE;
+int bitplane_stride = (SIMULATIONW + 63) / 64;
+
+atom_page empty_page;
+
+size_t bitplane_bytes() {
+	return sizeof(std::atomic<uint64_t>) * bitplane_stride * world_height;
+}
+
+// Empties every chunk and wakes it, the bitplanes are left alone
+void clear_chunks(atom_field * parts) {
+	for (int i = 0; i < chunk_columns * chunk_rows; i++)
+		free_page(parts, i);
+	for (int i = 0; i < chunk_columns * chunk_rows; i++) {
+		parts->chunks[i].active.store(false, std::memory_order_relaxed);
+		parts->chunks[i].dirty.store(true, std::memory_order_relaxed);
+		parts->chunks[i].idle_steps = 0;
+		for (int t = 0; t < TYPE_COUNT; t++)
+			parts->chunks[i].partcount[t].store(0, std::memory_order_relaxed);
+	}
+	clear_air(parts->air);
+}
+
+atom_field * create_atom_field(int width, int height) {
+	world_width = width;
+	world_height = height;
+	band_y0 = 0;
+	band_y1 = height;
+	chunk_columns = (width + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	chunk_rows = (height + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	bitplane_stride = (width + 63) / 64;
+
+	atom_field * parts = new atom_field;
+	parts->pages = new std::atomic<atom_page *>[chunk_columns * chunk_rows];
+	for (int i = 0; i < chunk_columns * chunk_rows; i++)
+		parts->pages[i].store(&empty_page, std::memory_order_relaxed);
+	parts->pagecount.store(0, std::memory_order_relaxed);
+	// Fresh mappings read as zero and are left untouched, the participants place them
+	parts->mutex = (std::atomic<uint64_t> *)allocate_pages(bitplane_bytes());
+	parts->occupied = (std::atomic<uint64_t> *)allocate_pages(bitplane_bytes());
+	parts->chunks = new chunk_state[chunk_columns * chunk_rows];
+	create_air(parts->air, width, height);
+	clear_chunks(parts);
+	slab_backing_logged = false;
+	return parts;
+}
+
+// Only words that are set are written, so parts of the bitplanes nothing
+// touched yet stay unplaced
+void clear_atom_field(atom_field * parts) {
+	for (int i = 0; i < bitplane_stride * world_height; i++) {
+		if (parts->mutex[i].load(std::memory_order_relaxed))
+			parts->mutex[i].store(0, std::memory_order_relaxed);
+		if (parts->occupied[i].load(std::memory_order_relaxed))
+			parts->occupied[i].store(0, std::memory_order_relaxed);
+	}
+	clear_chunks(parts);
+}
+
+void destroy_atom_field(atom_field * parts) {
+	for (int i = 0; i < chunk_columns * chunk_rows; i++)
+		free_page(parts, i);
+	delete[] parts->pages;
+	release_pages(parts->mutex, bitplane_bytes());
+	release_pages(parts->occupied, bitplane_bytes());
+	delete[] parts->chunks;
+	destroy_air(parts->air);
+	delete parts;
+	release_empty_slabs();
+}
+
+// Walks the cells an atom of type TYPE passes on its way from (x0, y0) to
+// (x1, y1), starting in cell (cellx, celly), with a grid DDA. Returns false at
+// the first cell the atom can not displace, which ends up in block, with the
+// last passable cell in clear. Leaving the grid ends the walk successfully.
+template<int TYPE>
+bool sweep_path(atom_field * parts, int cellx, int celly, float x0, float y0, float x1, float y1, int & clearx, int & cleary, int & blockx, int & blocky) {
+	float dx = x1 - x0;
+	float dy = y1 - y0;
+	int stepx = dx > 0.0f ? 1 : -1;
+	int stepy = dy > 0.0f ? 1 : -1;
+	// Cells are centred on whole coordinates, their edges lie on the halves
+	float deltax = dx != 0.0f ? fabsf(1.0f / dx) : FLT_MAX;
+	float deltay = dy != 0.0f ? fabsf(1.0f / dy) : FLT_MAX;
+	float nextx = dx != 0.0f ? ((cellx + 0.5f * stepx) - x0) / dx : FLT_MAX;
+	float nexty = dy != 0.0f ? ((celly + 0.5f * stepy) - y0) / dy : FLT_MAX;
+
+	// Consecutive cells mostly share a chunk
+	int chunk = -1;
+	const atom_page * page = nullptr;
+
+	int steps = abs(PART_POS_QUANT(x1) - cellx) + abs(PART_POS_QUANT(y1) - celly);
+	for (int step = 0; step < steps; step++) {
+		if (nextx < nexty) {
+			cellx += stepx;
+			nextx += deltax;
+		}
+		else {
+			celly += stepy;
+			nexty += deltay;
+		}
+		if (cellx < 0 || cellx >= world_width || celly < 0 || celly >= world_height)
+			return true;
+		if (CHUNK(cellx, celly) != chunk) {
+			chunk = CHUNK(cellx, celly);
+			page = parts->pages[chunk].load(std::memory_order_acquire);
+		}
+		if (!displaces(TYPE, page->type[CELL(cellx, celly)])) {
+			blockx = cellx;
+			blocky = celly;
+			return false;
+		}
+		clearx = cellx;
+		cleary = celly;
+	}
+	return true;
+}
+
+// Collisions take most of the velocity of whatever atom ends up in the cell
+inline void damp_velocity(atom_page * page, int i) {
+	page->vx[i] = store_velocity(load_velocity(page->vx[i]) * COLLISIONLOSS);
+	page->vy[i] = store_velocity(load_velocity(page->vy[i]) * COLLISIONLOSS);
+}
+
+// Per span state shared by the atom updates
+struct span_pass {
+	atom_field * parts;
+	thread_stats * stats;
+	bool batched;
+	integrate_batch batch;
+	neighbour_batch near;
+	neighbour_window window;
+	neighbour_rows rows;
+	int batchX;
+	int nearX;
+	uint64_t nearMoves;
+	// Pushes of the atoms in one air cell, added to it once the span moves on
+	int air_cell;
+	int32_t air_push[3];
+};
+
+inline void flush_air(span_pass & pass) {
+	if (pass.air_cell < 0)
+		return;
+	air_field & air = pass.parts->air;
+	air.push_x[pass.air_cell].fetch_add(pass.air_push[0], std::memory_order_relaxed);
+	air.push_y[pass.air_cell].fetch_add(pass.air_push[1], std::memory_order_relaxed);
+	air.push_p[pass.air_cell].fetch_add(pass.air_push[2], std::memory_order_relaxed);
+	pass.air_cell = -1;
+}
+
+inline void push_air(span_pass & pass, int gridX, int gridY, float vx, float vy, int32_t pressure) {
+	int cell = air_index(pass.parts->air, gridX / AIR_CELL, gridY / AIR_CELL);
+	if (cell != pass.air_cell) {
+		flush_air(pass);
+		pass.air_cell = cell;
+		pass.air_push[0] = pass.air_push[1] = pass.air_push[2] = 0;
+	}
+	pass.air_push[0] += (int32_t)lrintf(vx * AIR_PUSH_ONE);
+	pass.air_push[1] += (int32_t)lrintf(vy * AIR_PUSH_ONE);
+	pass.air_push[2] += pressure;
+}
+
+// Everything after the integration of an atom of type TYPE, the traits of the
+// type are constants here so every branch on them is resolved at compile time
+template<int TYPE>
+inline void update_atom(span_pass & pass, atom_page * page, int i, int gridX, int gridY) {
+	constexpr element_traits traits = elements[TYPE];
+	atom_field * parts = pass.parts;
+	thread_stats & stats = *pass.stats;
+
+	int neighbourSpace, neighbourDiverse;
+	bool neighbourBlocking;
+	float mv, travel, resultx, resulty;
+	int resultx_quant, resulty_quant;
+
+	rng_stream rng(step_key, gridX, gridY);
+
+	if (pass.batched) {
+		page->vx[i] = store_velocity(pass.batch.vx[gridX - pass.batchX]);
+		page->vy[i] = store_velocity(pass.batch.vy[gridX - pass.batchX]);
+	}
+	else {
+		integrate_cell<TYPE>(page, i);
+	}
+
+	if (traits.diffusion != 0.0f) {
+		page->vx[i] = store_velocity(load_velocity(page->vx[i]) + randfd(rng) * traits.diffusion);
+		page->vy[i] = store_velocity(load_velocity(page->vy[i]) + randfd(rng) * traits.diffusion);
+	}
+
+	// Drag trades velocity with the air, which only takes it up after the step
+	if (traits.air_drag != 0.0f && air_enabled) {
+		float air_vx, air_vy;
+		air_velocity(parts->air, air_index(parts->air, gridX / AIR_CELL, gridY / AIR_CELL), air_vx, air_vy);
+		float vx = load_velocity(page->vx[i]);
+		float vy = load_velocity(page->vy[i]);
+		float drag_x = (air_vx - vx) * traits.air_drag;
+		float drag_y = (air_vy - vy) * traits.air_drag;
+		page->vx[i] = store_velocity(vx + drag_x);
+		page->vy[i] = store_velocity(vy + drag_y);
+		push_air(pass, gridX, gridY, -drag_x, -drag_y, (int32_t)(traits.air_pressure * AIR_PUSH_ONE));
+	}
+
+	if (pass.batched && stats.moves == pass.nearMoves) {
+		neighbourSpace = pass.near.space[gridX - pass.nearX];
+		neighbourDiverse = pass.near.diverse[gridX - pass.nearX];
+		neighbourBlocking = pass.near.blocking[gridX - pass.nearX];
+	}
+	else {
+		gather_rows(parts, page, gridX, gridY, 1, pass.window, pass.rows);
+		scan_neighbours<TYPE>(pass.rows, neighbourSpace, neighbourDiverse, neighbourBlocking);
+	}
+
+	if (neighbourBlocking) {
+		page->vx[i] = store_velocity(0.0f);
+		page->vy[i] = store_velocity(0.0f);
+		return;
+	}
+
+	// The atom stays in its cell until a move succeeds
+	float vx = load_velocity(page->vx[i]);
+	float vy = load_velocity(page->vy[i]);
+
+	if (!traits.moves || (fabsf(vx) <= 0.01f && fabsf(vy) <= 0.01f))
+		return;
+
+	float x = load_position(page->x[i], gridX);
+	float y = load_position(page->y[i], gridY);
+
+	mv = fmaxf(fabsf(vx), fabsf(vy));
+
+	// Regions running in the same phase must not reach into each other
+	travel = mv > move_limit ? move_limit / mv : 1.0f;
+
+	resultx = x + vx * travel;
+	resulty = y + vy * travel;
+
+	int clearx = gridX;
+	int cleary = gridY;
+
+	float clearxf = x;
+	float clearyf = y;
+
+	// Slow atoms only ever reach a neighbour, fast ones sweep their path and
+	// stop in front of the first cell they can not displace
+	if (mv * travel >= ISTP) {
+		int blockx, blocky;
+		if (!sweep_path<TYPE>(parts, gridX, gridY, x, y, resultx, resulty, clearx, cleary, blockx, blocky)) {
+			if (clearx != gridX || cleary != gridY) {
+				clearxf = (float)clearx;
+				clearyf = (float)cleary;
+				if (do_move<TYPE>(parts, stats, gridX, gridY, clearxf, clearyf)) {
+					damp_velocity(page_at(parts, clearx, cleary), CELL(clearx, cleary));
+					return;
+				}
+			}
+			// The obstacle is next to the atom, the collision handling below takes over
+			resultx = (float)blockx;
+			resulty = (float)blocky;
+		}
+	}
+
+	resultx_quant = PART_POS_QUANT(resultx);
+	resulty_quant = PART_POS_QUANT(resulty);
+
+	if (resultx_quant == gridX && resulty_quant == gridY)
+		return;
+	if (do_move<TYPE>(parts, stats, gridX, gridY, resultx, resulty))
+		return;
+
+	if (traits.collision == COLLIDE_REFLECT) {
+		stats.collisions++;
+		if (do_move<TYPE>(parts, stats, gridX, gridY, 0.25f + (float)(2 * gridX - resultx_quant), 0.25f + resulty_quant))
+		{
+			page->vx[i] = store_velocity(load_velocity(page->vx[i]) * COLLISIONLOSS);
+		}
+		else if (do_move<TYPE>(parts, stats, gridX, gridY, 0.25f + resultx_quant, 0.25f + (float)(2 * gridY - resulty_quant)))
+		{
+			page->vy[i] = store_velocity(load_velocity(page->vy[i]) * COLLISIONLOSS);
+		}
+		else
+		{
+			damp_velocity(page, i);
+		}
+	}
+	else if (traits.collision == COLLIDE_SLIDE) {
+		stats.collisions++;
+		if (resultx_quant != gridX && do_move<TYPE>(parts, stats, gridX, gridY, resultx, gridY))
+		{
+			damp_velocity(page, i);
+			return;
+		}
+		else if (resulty_quant != gridY && do_move<TYPE>(parts, stats, gridX, gridY, gridX, resulty))
+		{
+			damp_velocity(page, i);
+			return;
+		}
+		int scanDirection = randd(rng);
+		if (clearx != gridX || cleary != gridY || neighbourDiverse || neighbourSpace)
+		{
+			float dx = vx - vy * scanDirection;
+			float dy = vy + vx * scanDirection;
+			if (fabsf(dy) > fabsf(dx))
+				mv = fabsf(dy);
+			else
+				mv = fabsf(dx);
+			dx /= mv;
+			dy /= mv;
+			if (do_move<TYPE>(parts, stats, gridX, gridY, clearxf + dx, clearyf + dy))
+			{
+				damp_velocity(page, i);
+				return;
+			}
+			float swappage = dx;
+			dx = dy * scanDirection;
+			dy = -swappage * scanDirection;
+			if (do_move<TYPE>(parts, stats, gridX, gridY, clearxf + dx, clearyf + dy))
+			{
+				damp_velocity(page, i);
+				return;
+			}
+		}
+		damp_velocity(page, i);
+	}
+}
+
+// Dispatches to the update of the type, the comparisons fold into a jump
+// table. TYPE_NONE cells are never dispatched, an added type needs no changes.
+template<int TYPE>
+inline void dispatch_atom(uint8_t type, span_pass & pass, atom_page * page, int i, int gridX, int gridY) {
+	if (type == TYPE)
+		update_atom<TYPE>(pass, page, i, gridX, gridY);
+	else
+		dispatch_atom<TYPE + 1>(type, pass, page, i, gridX, gridY);
+}
+
+template<>
+inline void dispatch_atom<TYPE_COUNT>(uint8_t, span_pass &, atom_page *, int, int, int) {
+}
+
+void simulate_region(atom_field * parts, region_bounds region, bool mutex, thread_stats & stats) {
+	int spanEnd;
+	span_pass pass;
+	pass.parts = parts;
+	pass.stats = &stats;
+	pass.batched = kernels.integrate != nullptr;
+	pass.air_cell = -1;
+
+	for (int gridY = region.y; gridY < region.y + region.h; gridY++) {
+		if (gridY == 0 || gridY == world_height - 1)
+			continue;
+		for (int spanX = region.x; spanX < region.x + region.w; spanX = spanEnd) {
+			spanEnd = std::min(region.x + region.w, (spanX / CHUNK_SIZE + 1) * CHUNK_SIZE);
+			chunk_state & chunk = parts->chunks[CHUNK(spanX, gridY)];
+			if (chunk.idle_steps >= CHUNK_SLEEP_STEPS) {
+				stats.cells_skipped += spanEnd - spanX;
+				continue;
+			}
+
+			// A span never leaves its chunk, the page is only replaced when a move
+			// into an empty chunk allocates it
+			atom_page * page = parts->pages[CHUNK(spanX, gridY)].load(std::memory_order_acquire);
+
+			uint32_t span_particles[TYPE_COUNT] = {};
+			int batchEnd = 0, nearEnd = 0;
+			// Only occupied cells are visited, the bitmap is reread after every cell
+			// as the moves of this row change it
+			int firstX = std::max(spanX, 1), lastX = std::min(spanEnd, world_width - 1);
+			for (int gridX = next_occupied(parts, firstX, lastX, gridY); gridX < lastX; gridX = next_occupied(parts, gridX + 1, lastX, gridY)) {
+				if (page == &empty_page)
+					page = page_at(parts, gridX, gridY);
+				int i = CELL(gridX, gridY);
+				uint8_t type = page->type[i];
+
+				if (type == TYPE_NONE)
+					continue;
+
+				span_particles[type]++;
+
+				if ((block_types >> type) & 1)
+					continue;
+
+				if (get_mutex(parts, gridX, gridY) == mutex)
+					continue;
+
+				set_mutex(parts, gridX, gridY, mutex);
+
+				// With SIMD kernels integration runs ahead in batches. Moves only change the
+				// current cell and cells that are already processed, so batched velocities
+				// stay valid, but a move makes the rest of the neighbour batch stale.
+				// The noise is drawn per cell, cells ahead may still be moved into.
+				if (pass.batched) {
+					if (gridX >= batchEnd) {
+						pass.batchX = gridX;
+						batchEnd = std::min(spanEnd, gridX + INTEGRATE_BATCH);
+						kernels.integrate(page->type + i, page->vx + i, page->vy + i, pass.batch);
+					}
+					if (gridX >= nearEnd) {
+						pass.nearX = gridX;
+						nearEnd = std::min(spanEnd, gridX + INTEGRATE_BATCH);
+						pass.nearMoves = stats.moves;
+						gather_rows(parts, page, gridX, gridY, INTEGRATE_BATCH, pass.window, pass.rows);
+						kernels.neighbours(pass.rows, pass.near);
+					}
+				}
+
+				dispatch_atom<TYPE_NONE + 1>(type, pass, page, i, gridX, gridY);
+			}
+			flush_air(pass);
+
+			for (int t = TYPE_NONE + 1; t < TYPE_COUNT; t++) {
+				if (span_particles[t]) {
+					stats.particles[t] += span_particles[t];
+					chunk.partcount[t].fetch_add(span_particles[t], std::memory_order_relaxed);
+				}
+			}
+		}
+	}
+}
+
+int threadcount = 0;
+int regioncount = 0;
+int region_group_count = 0;
+region_bounds * regions;
+region_bounds ** region_groups;
+thread_pool * pool = nullptr;
+phase_barrier group_barrier;
+
+// Tile scheduler, tiles of one colour are never adjacent and are handed out
+// to the participants on demand
+#define TILE_COLOURS 4
+std::vector<region_bounds> tiles[TILE_COLOURS];
+std::atomic<int> tile_cursor[TILE_COLOURS];
+
+// Task scheduling, one task per region or tile that waits only for the
+// neighbours it follows. Tasks are numbered like region_ms.
+bool task_scheduling = true;
+task_graph step_tasks;
+std::vector<region_bounds> task_regions;
+std::vector<int> task_phases;		// region group or tile colour of every task
+std::vector<int> phase_sizes;
+std::unique_ptr<std::atomic<int>[]> phase_left;	// tasks of each phase still to run this step
+
+// Strip balancing. Every chunk column costs the atoms of its awake chunks
+// plus a little for scanning them, smoothed over a few steps. Boundaries
+// start moving once the costliest region is REBALANCE_START above the mean,
+// stop once it is within REBALANCE_STOP and move REBALANCE_STEP cells per
+// step at most, so noise does not make them wander.
+#define REBALANCE_START 0.15
+#define REBALANCE_STOP 0.05
+#define REBALANCE_STEP 8
+#define REBALANCE_SMOOTHING 0.25
+#define AWAKE_CHUNK_COST 32.0
+bool balance_regions = true;
+bool rebalancing = false;
+std::vector<double> column_cost;
+std::vector<double> cost_prefix;	// cost of the columns left of each one
+
+bool mutex = true;
+
+// Per participant counters and timings, reduced into last_stats after every step
+thread_stats * participant_stats = nullptr;
+std::vector<std::chrono::steady_clock::time_point> phase_marks;
+step_stats last_stats;
+
+double elapsed_ms(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void seed_simulation(uint64_t seed) {
+	simulation_seed = seed;
+	simulation_step = 0;
+	step_key = rng_step_key(simulation_seed, simulation_step);
+	mutex = true;
+}
+
+bool processed_flag() {
+	return mutex;
+}
+
+void resume_simulation(uint64_t seed, uint64_t step, bool processed) {
+	simulation_seed = seed;
+	simulation_step = step;
+	step_key = rng_step_key(simulation_seed, simulation_step);
+	mutex = processed;
+}
+
+// Pins every participant to its core, or lets them run anywhere again once
+// pinning is switched off
+void pin_participants() {
+	static bool pinned = false;
+	std::vector<int> cores = pin_cores(thread_pinning, pinned_cores, threadcount);
+	if (cores.empty() && !pinned)
+		return;
+	std::atomic<bool> failed(false);
+	pool->run([&cores, &failed](int threadid) {
+		if (!pin_thread(cores.empty() ? -1 : cores[threadid]) && cores.size())
+			failed.store(true, std::memory_order_relaxed);
+	});
+	pinned = !cores.empty();
+	if (failed) {
+		*simulation_log << "could not pin the participants." << std::endl;
+	}
+	else if (pinned) {
+		*simulation_log << "pinned participants to cores";
+		for (int core : cores)
+			*simulation_log << " " << core;
+		*simulation_log << "." << std::endl;
+	}
+}
+
+void reset_tasks(int phasecount) {
+	step_tasks.clear();
+	task_regions.clear();
+	task_phases.clear();
+	phase_sizes.assign(phasecount, 0);
+	phase_left.reset(new std::atomic<int>[phasecount]);
+}
+
+int add_step_task(region_bounds region, int phase, int home) {
+	task_regions.push_back(region);
+	task_phases.push_back(phase);
+	phase_sizes[phase]++;
+	return step_tasks.add_task(home);
+}
+
+// Orders two neighbouring tasks like the phases would
+void add_phase_edge(int a, int b) {
+	if (task_phases[a] < task_phases[b])
+		step_tasks.add_edge(a, b);
+	else if (task_phases[b] < task_phases[a])
+		step_tasks.add_edge(b, a);
+}
+
+// A tile only reaches into the eight tiles around it, which all have another
+// colour. Neighbouring tiles start out on the same participant.
+void build_tile_tasks() {
+	int columns = (world_width + tile_width - 1) / tile_width;
+	int row0 = band_y0 / tile_height;
+	int rows = (band_y1 + tile_height - 1) / tile_height - row0;
+	std::vector<int> task_at(columns * rows);
+
+	reset_tasks(TILE_COLOURS);
+	for (int colour = 0; colour < TILE_COLOURS; colour++) {
+		for (auto & tile : tiles[colour]) {
+			int position = (tile.y / tile_height - row0) * columns + tile.x / tile_width;
+			task_at[position] = add_step_task(tile, colour, position * threadcount / (columns * rows));
+		}
+	}
+
+	for (int y = 0; y < rows; y++) {
+		for (int x = 0; x < columns; x++) {
+			if (x + 1 < columns)
+				add_phase_edge(task_at[y * columns + x], task_at[y * columns + x + 1]);
+			if (y + 1 == rows)
+				continue;
+			for (int dx = -1; dx <= 1; dx++)
+				if (x + dx >= 0 && x + dx < columns)
+					add_phase_edge(task_at[y * columns + x], task_at[(y + 1) * columns + x + dx]);
+		}
+	}
+}
+
+// A strip only borders the strips either side of it, which belong to other
+// groups unless there is only one. Strips start out on the participant that
+// runs them with barriers.
+void build_strip_tasks() {
+	reset_tasks(region_group_count);
+	for (int i = 0; i < regioncount; i++)
+		add_step_task(regions[i], i % region_group_count, i / region_group_count);
+	for (int i = 0; i + 1 < regioncount; i++)
+		add_phase_edge(i, i + 1);
+}
+
+// Runs the step as tasks, a phase ends with the last of its tasks
+void run_step_tasks(atom_field * parts) {
+	typedef std::chrono::steady_clock clock;
+	for (size_t i = 0; i < phase_sizes.size(); i++)
+		phase_left[i].store(phase_sizes[i], std::memory_order_relaxed);
+	step_tasks.prepare(threadcount);
+
+	const char * name = scheduler == SCHEDULER_TILES ? "tile" : "region";
+	pool->run([parts, name](int threadid) {
+		thread_stats & stats = participant_stats[threadid];
+		memset(&stats, 0, sizeof(stats));
+		double busy = 0.0;
+		step_tasks.run(threadid, [parts, name, &stats, &busy](int task) {
+			clock::time_point start = clock::now();
+			{
+				trace_scope scope(name, task, true);
+				simulate_region(parts, task_regions[task], mutex, stats);
+			}
+			clock::time_point end = clock::now();
+			double region_time = elapsed_ms(start, end);
+			last_stats.region_ms[task] = region_time;
+			busy += region_time;
+			int phase = task_phases[task];
+			if (phase_left[phase].fetch_sub(1, std::memory_order_acq_rel) == 1)
+				phase_marks[phase + 1] = end;
+		});
+		last_stats.thread_ms[threadid] = busy;
+	});
+}
+
+// Strips running at the same time have at least a strip between them, with
+// barriers as with tasks. Like tiles, neither side may reach past half of the
+// narrowest one. A single participant runs the strips one after another.
+void limit_strip_moves() {
+	if (threadcount == 1) {
+		move_limit = FLT_MAX;
+		return;
+	}
+	int narrowest = world_width;
+	for (int i = 0; i < regioncount; i++)
+		narrowest = std::min(narrowest, regions[i].w);
+	move_limit = (float)std::max(narrowest / 2 - 1, 1);
+}
+
+void release_regions() {
+	for (int i = 0; i < region_group_count; i++)
+		delete[] region_groups[i];
+	delete[] region_groups;
+	delete[] regions;
+	region_group_count = 0;
+	regioncount = 0;
+	region_groups = nullptr;
+	regions = nullptr;
+
+	for (int i = 0; i < TILE_COLOURS; i++)
+		tiles[i].clear();
+
+	delete[] participant_stats;
+	participant_stats = nullptr;
+}
+
+void init_tiles() {
+	tile_width = std::max(tile_width, TILE_MIN_SIZE);
+	tile_height = std::max(tile_height, TILE_MIN_SIZE);
+
+	for (int tile_y = band_y0 / tile_height; tile_y * tile_height < band_y1; tile_y++) {
+		for (int tile_x = 0; tile_x * tile_width < world_width; tile_x++) {
+			region_bounds tile;
+			tile.x = tile_x * tile_width;
+			tile.y = tile_y * tile_height;
+			tile.w = std::min(tile_width, world_width - tile.x);
+			tile.h = std::min(tile_height, world_height - tile.y);
+			tiles[(tile_x & 1) | ((tile_y & 1) << 1)].push_back(tile);
+		}
+	}
+
+	// Two tiles of a colour are a whole tile apart, neither may reach past half of it
+	move_limit = std::min(tile_width, tile_height) / 2 - 1;
+
+	size_t tilecount = 0;
+	for (int i = 0; i < TILE_COLOURS; i++)
+		tilecount += tiles[i].size();
+	last_stats.phase_ms.assign(TILE_COLOURS, 0.0);
+	last_stats.region_ms.assign(tilecount, 0.0);
+	build_tile_tasks();
+
+	*simulation_log << "configured thread pool: " << threadcount << std::endl;
+	*simulation_log << "configured tile pool: " << tile_width << "x" << tile_height << " tiles in " << TILE_COLOURS << " colours." << std::endl;
+}
+
+void init_simulation(int threadcount_, int groupcount_) {
+	threadcount = threadcount_;
+
+	if (pool)
+		pool->resize(threadcount);
+	else
+		pool = new thread_pool(threadcount);
+	group_barrier.reset(threadcount);
+	pin_participants();
+
+	participant_stats = new thread_stats[threadcount];
+	last_stats.thread_ms.assign(threadcount, 0.0);
+
+	// Tiles do not depend on the thread count, which makes the result reproducible.
+	// Only tiles keep the neighbouring bands of a split world apart.
+	if (deterministic || band_y0 != 0 || band_y1 != world_height)
+		scheduler = SCHEDULER_TILES;
+
+	if (scheduler == SCHEDULER_TILES) {
+		init_tiles();
+		return;
+	}
+	rebalancing = false;
+	column_cost.clear();
+
+	region_group_count = std::min(groupcount_, threadcount);
+	regioncount = threadcount_*region_group_count;
+
+	regions = new region_bounds[regioncount];
+	region_groups = new region_bounds*[region_group_count];
+	for (int i = 0; i < region_group_count; i++)
+		region_groups[i] = new region_bounds[threadcount];
+
+	int regionwidth = world_width / regioncount;
+	for (int i = 0; i < regioncount; i++) {
+		regions[i].w = regionwidth;
+		regions[i].h = world_height;
+		regions[i].x = regionwidth * i;
+		regions[i].y = 0;
+		
+		if (i == regioncount - 1) {
+			if ((regions[i].w + regions[i].x) != world_width) {
+				regions[i].w += world_width - (regions[i].w + regions[i].x);
+			}
+		}
+
+
+		region_groups[i % region_group_count][i / region_group_count] = regions[i];
+	}
+
+	last_stats.phase_ms.assign(region_group_count, 0.0);
+	last_stats.region_ms.assign(regioncount, 0.0);
+	limit_strip_moves();
+	build_strip_tasks();
+
+	*simulation_log << "configured thread pool: " << threadcount << std::endl;
+	*simulation_log << "configured region pool: " << regioncount << " in " << region_group_count << " groups." << std::endl;
+}
+
+void shutdown_simulation() {
+	delete pool;
+	pool = nullptr;
+	release_regions();
+}
+
+// The pool is resized in place, only the regions are rebuilt
+void reinit_simulation(int threadcount_, int groupcount_) {
+	release_regions();
+	init_simulation(threadcount_, groupcount_);
+}
+
+// Chunks that saw no movement for CHUNK_SLEEP_STEPS steps are skipped until
+// something moves into or next to them. Sleeping chunks still report the
+// particles they held when they were last simulated. Only active chunks can
+// have emptied out, their pages are freed when they did.
+void update_chunks(atom_field * parts) {
+	int band_chunk0 = band_y0 / CHUNK_SIZE * chunk_columns;
+	int band_chunk1 = (band_y1 + CHUNK_SIZE - 1) / CHUNK_SIZE * chunk_columns;
+	for (int i = 0; i < chunk_columns * chunk_rows; i++) {
+		chunk_state & chunk = parts->chunks[i];
+		if (chunk.idle_steps >= CHUNK_SLEEP_STEPS && i >= band_chunk0 && i < band_chunk1) {
+			for (int t = TYPE_NONE + 1; t < TYPE_COUNT; t++)
+				last_stats.particles[t] += chunk.partcount[t].load(std::memory_order_relaxed);
+		}
+
+		if (chunk.active.load(std::memory_order_relaxed)) {
+			chunk.active.store(false, std::memory_order_relaxed);
+			chunk.idle_steps = 0;
+			if (parts->pages[i].load(std::memory_order_relaxed) != &empty_page && chunk_empty(parts, i))
+				free_page(parts, i);
+		}
+		else if (chunk.idle_steps < CHUNK_SLEEP_STEPS) {
+			chunk.idle_steps++;
+		}
+
+		if (chunk.idle_steps < CHUNK_SLEEP_STEPS) {
+			for (int t = 0; t < TYPE_COUNT; t++)
+				chunk.partcount[t].store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+// Recounts the solid cells of air rows [y0, y1), only in the chunks that were
+// active this step unless all is set. The border stays closed.
+void block_air_rows(atom_field * parts, int y0, int y1, bool all) {
+	static_assert(AIR_CELL == 4 && CHUNK_SIZE % 8 == 0, "two air cells per 8 byte word of a row");
+	const uint64_t ones = 0x0101010101010101, high = 0x7F7F7F7F7F7F7F7F;
+	air_field & air = parts->air;
+	for (int ay = std::max(y0, 1); ay < std::min(y1, air.height - 1); ay++) {
+		int cell_y = ay * AIR_CELL;
+		for (int chunk_x = 0; chunk_x < chunk_columns; chunk_x++) {
+			int chunk = CHUNK(chunk_x * CHUNK_SIZE, cell_y);
+			if (!all && !parts->chunks[chunk].active.load(std::memory_order_relaxed))
+				continue;
+			// Pages hold whole chunks, cells past the world are empty
+			const atom_page * page = parts->pages[chunk].load(std::memory_order_acquire);
+			for (int word = 0; word < CHUNK_SIZE / 8; word++) {
+				// Solid cells of each column in one byte each
+				uint64_t counts = 0;
+				if (page != &empty_page) {
+					for (int y = cell_y; y < cell_y + AIR_CELL; y++) {
+						uint64_t types;
+						memcpy(&types, page->type + CELL(0, y) + word * 8, sizeof(types));
+						types ^= ones * TYPE_SOLID;
+						counts += (~(((types & high) + high) | types) >> 7) & ones;
+					}
+				}
+				for (int half = 0; half < 2; half++) {
+					int ax = (chunk_x * CHUNK_SIZE + word * 8) / AIR_CELL + half;
+					int solids = (int)(((uint32_t)(counts >> (32 * half)) * 0x01010101u) >> 24);
+					if (ax >= 1 && ax < air.width - 1)
+						air.open[air_index(air, ax, ay)] = solids >= AIR_BLOCK_SOLIDS ? 0.0f : 1.0f;
+				}
+			}
+		}
+	}
+}
+
+void block_air(atom_field * parts) {
+	block_air_rows(parts, 0, parts->air.height, true);
+}
+
+// Air this fast drags the most dragged element past the move threshold
+constexpr float air_wake_velocity = 0.01f / max_air_drag();
+
+// Wakes the sleeping chunks of the band either side of every edge of air rows
+// [y0, y1) the air just solved blows across fast enough to move atoms. Only
+// the edges of its own rows are read, other participants may still be
+// solving theirs.
+void wake_windy_chunks(atom_field * parts, int y0, int y1) {
+	air_field & air = parts->air;
+	int next = !air.current;
+	auto wake = [parts](int ax, int ay) {
+		int x = ax * AIR_CELL, y = ay * AIR_CELL;
+		if (x >= world_width || y < band_y0 || y >= band_y1)
+			return;
+		int chunk = CHUNK(x, y);
+		std::atomic<bool> & active = parts->chunks[chunk].active;
+		if (!active.load(std::memory_order_relaxed) && parts->pages[chunk].load(std::memory_order_relaxed) != &empty_page)
+			active.store(true, std::memory_order_relaxed);
+	};
+	for (int ay = y0; ay < y1; ay++) {
+		for (int ax = 0; ax < air.width; ax++) {
+			int index = air_index(air, ax, ay);
+			if (fabsf(air.vx[next][index]) >= air_wake_velocity) {
+				wake(ax, ay);
+				wake(ax + 1, ay);
+			}
+			if (fabsf(air.vy[next][index]) >= air_wake_velocity) {
+				wake(ax, ay);
+				wake(ax, ay + 1);
+			}
+		}
+	}
+}
+
+// Barrier between the phases of a step, traced as the time spent waiting
+void wait_phase() {
+	trace_scope scope("barrier");
+	group_barrier.arrive_and_wait();
+}
+
+// Adds the pushes of the step to the air and solves it. Every participant
+// takes a fixed share of the air rows of the band, so the result does not
+// depend on which one finishes first. A partial band also solves the air row
+// either side of it, which the atoms along its edges read. Chunks the air
+// wakes are simulated from the next step on.
+void step_air(atom_field * parts) {
+	int y0 = band_y0 / AIR_CELL, y1 = (band_y1 + AIR_CELL - 1) / AIR_CELL;
+	int solve0 = std::max(y0 - 1, 0), solve1 = std::min(y1 + 1, parts->air.height);
+	pool->run([parts, y0, y1, solve0, solve1](int threadid) {
+		int first = y0 + (y1 - y0) * threadid / threadcount;
+		int last = y0 + (y1 - y0) * (threadid + 1) / threadcount;
+		block_air_rows(parts, first, last, false);
+		fold_air_pushes(parts->air, first, last);
+		wait_phase();
+		if (air_pushes_done) {
+			if (!threadid)
+				air_pushes_done(parts);
+			wait_phase();
+		}
+		first = solve0 + (solve1 - solve0) * threadid / threadcount;
+		last = solve0 + (solve1 - solve0) * (threadid + 1) / threadcount;
+		solve_air(parts->air, first, last);
+		wake_windy_chunks(parts, first, last);
+	});
+	parts->air.current = !parts->air.current;
+}
+
+// The block pass stands in TYPE_SOLID for the edges of the world
+static_assert(block_class_of(TYPE_SOLID) == BLOCK_FIXED, "solids have to stay put in blocks");
+
+// Blocks draw from streams of their own, apart from the cells at the same coordinates
+#define BLOCK_STREAM 0x6A09E667F3BCC908ULL
+
+std::atomic<int> block_cursor;
+
+// Moves the atoms of the block with its top left cell at (x, y) as the table entry says
+void rearrange_cells(atom_field * parts, int x, int y, uint8_t rule, thread_stats & stats) {
+	int cell_x[4] = { x, x + 1, x, x + 1 }, cell_y[4] = { y, y, y + 1, y + 1 };
+	uint8_t type[4];
+	atom_velocity vx[4], vy[4];
+	for (int n = 0; n < 4; n++) {
+		const atom_page * page = page_at(parts, cell_x[n], cell_y[n]);
+		int c = CELL(cell_x[n], cell_y[n]);
+		type[n] = page->type[c];
+		vx[n] = page->vx[c];
+		vy[n] = page->vy[c];
+	}
+	for (int n = 0; n < 4; n++) {
+		int source = (rule >> (2 * n)) & 3;
+		if (source == n || (type[source] == TYPE_NONE && type[n] == TYPE_NONE))
+			continue;
+		int gridX = cell_x[n], gridY = cell_y[n];
+		// A cell left empty held an atom before, so its page exists
+		atom_page * page = type[source] == TYPE_NONE ? page_at(parts, gridX, gridY) : writable_page(parts, gridX, gridY);
+		int c = CELL(gridX, gridY);
+		page->type[c] = type[source];
+		page->vx[c] = vx[source];
+		page->vy[c] = vy[source];
+		page->x[c] = store_position((float)gridX, gridX);
+		page->y[c] = store_position((float)gridY, gridY);
+		set_occupied(parts, gridX, gridY, type[source] != TYPE_NONE);
+		set_mutex(parts, gridX, gridY, mutex);
+		mark_dirty(parts, gridX, gridY);
+		wake_chunks(parts, gridX, gridY);
+		if (type[source] != TYPE_NONE)
+			stats.moves++;
+	}
+}
+
+// Blocks of rows y and y + 1, the first one starting at column offset. Rows
+// are classified a chunk wide at a time and only blocks whose table entry
+// moves something touch the pages.
+void simulate_block_row(atom_field * parts, int y, int offset, uint64_t key, thread_stats & stats) {
+	uint8_t rows[2][CHUNK_SIZE];
+	uint16_t indices[CHUNK_SIZE / 2];
+	for (int spanX = offset; spanX + 1 < world_width; spanX += CHUNK_SIZE) {
+		int width = std::min(CHUNK_SIZE, world_width - spanX) & ~1;
+		int spanEnd = spanX + width;
+		bool awake = false;
+		for (int r = 0; r < 2; r++)
+			awake = awake || parts->chunks[CHUNK(spanX, y + r)].idle_steps < CHUNK_SLEEP_STEPS || parts->chunks[CHUNK(spanEnd - 1, y + r)].idle_steps < CHUNK_SLEEP_STEPS;
+		if (!awake || (next_occupied(parts, spanX, spanEnd, y) == spanEnd && next_occupied(parts, spanX, spanEnd, y + 1) == spanEnd))
+			continue;
+
+		copy_row(parts, spanX, y, width, rows[0]);
+		copy_row(parts, spanX, y + 1, width, rows[1]);
+		// The edges of the world never move
+		if (y == 0)
+			memset(rows[0], TYPE_SOLID, width);
+		if (y + 1 == world_height - 1)
+			memset(rows[1], TYPE_SOLID, width);
+		if (spanX == 0)
+			rows[0][0] = rows[1][0] = TYPE_SOLID;
+		if (spanEnd == world_width)
+			rows[0][width - 1] = rows[1][width - 1] = TYPE_SOLID;
+
+		block_indices(rows[0], rows[1], width / 2, rng_stream(key, spanX, y).next(), indices);
+		for (int n = 0; n < width / 2; n++) {
+			uint8_t rule = block_rules[indices[n]];
+			if (rule != BLOCK_IDENTITY)
+				rearrange_cells(parts, spanX + 2 * n, y, rule, stats);
+		}
+	}
+}
+
+// Runs after the atom pass. Blocks never overlap, so the rows of blocks are
+// handed out to the participants on demand and the result does not depend
+// on who takes which.
+void step_blocks(atom_field * parts) {
+	typedef std::chrono::steady_clock clock;
+	int offset = simulation_step & 1;
+	int rows = (world_height - offset) / 2;
+	uint64_t key = rng_mix(step_key ^ BLOCK_STREAM);
+	block_cursor.store(0, std::memory_order_relaxed);
+	pool->run([parts, offset, rows, key](int threadid) {
+		clock::time_point start = clock::now();
+		thread_stats & stats = participant_stats[threadid];
+		int row;
+		while ((row = block_cursor.fetch_add(1, std::memory_order_relaxed)) < rows)
+			simulate_block_row(parts, offset + 2 * row, offset, key, stats);
+		last_stats.thread_ms[threadid] += elapsed_ms(start, clock::now());
+	});
+}
+
+// Has to run before update_chunks, which clears the counts of the awake chunks
+void measure_columns(atom_field * parts) {
+	if ((int)column_cost.size() != chunk_columns) {
+		column_cost.assign(chunk_columns, 0.0);
+		cost_prefix.assign(chunk_columns + 1, 0.0);
+	}
+	for (int column = 0; column < chunk_columns; column++) {
+		double cost = 0.0;
+		for (int row = 0; row < chunk_rows; row++) {
+			chunk_state & chunk = parts->chunks[row * chunk_columns + column];
+			if (chunk.idle_steps >= CHUNK_SLEEP_STEPS)
+				continue;
+			cost += AWAKE_CHUNK_COST;
+			for (int t = TYPE_NONE + 1; t < TYPE_COUNT; t++)
+				cost += chunk.partcount[t].load(std::memory_order_relaxed);
+		}
+		column_cost[column] += (cost - column_cost[column]) * REBALANCE_SMOOTHING;
+		cost_prefix[column + 1] = cost_prefix[column] + column_cost[column];
+	}
+}
+
+// Cost spreads evenly over the cells of a chunk column
+double cost_left_of(int x) {
+	int column = std::min(x / CHUNK_SIZE, chunk_columns - 1);
+	int column_x = column * CHUNK_SIZE;
+	int column_w = std::min(CHUNK_SIZE, world_width - column_x);
+	return cost_prefix[column] + column_cost[column] * (x - column_x) / column_w;
+}
+
+int cell_at_cost(double cost) {
+	int column = (int)(std::upper_bound(cost_prefix.begin() + 1, cost_prefix.end() - 1, cost) - cost_prefix.begin()) - 1;
+	int column_x = column * CHUNK_SIZE;
+	int column_w = std::min(CHUNK_SIZE, world_width - column_x);
+	if (column_cost[column] <= 0.0)
+		return column_x;
+	return column_x + (int)lround((cost - cost_prefix[column]) / column_cost[column] * column_w);
+}
+
+// Moves every strip boundary towards where it splits the measured cost evenly.
+// Only runs between steps, the regions keep their groups and their order.
+void balance_strips() {
+	double total = cost_prefix[chunk_columns];
+	if (total <= 0.0)
+		return;
+
+	double mean = total / regioncount, costliest = 0.0;
+	for (int i = 0; i < regioncount; i++)
+		costliest = std::max(costliest, cost_left_of(regions[i].x + regions[i].w) - cost_left_of(regions[i].x));
+	if (costliest > mean * (1.0 + REBALANCE_START))
+		rebalancing = true;
+	else if (costliest < mean * (1.0 + REBALANCE_STOP))
+		rebalancing = false;
+	if (!rebalancing)
+		return;
+
+	int min_width = std::min(REGION_MIN_WIDTH, world_width / regioncount);
+	std::vector<int> edges(regioncount + 1);
+	edges[0] = 0;
+	edges[regioncount] = world_width;
+	for (int i = 1; i < regioncount; i++) {
+		int shift = cell_at_cost(total * i / regioncount) - regions[i].x;
+		edges[i] = regions[i].x + std::min(std::max(shift, -REBALANCE_STEP), REBALANCE_STEP);
+	}
+	for (int i = 1; i < regioncount; i++)
+		edges[i] = std::max(edges[i], edges[i - 1] + min_width);
+	for (int i = regioncount - 1; i > 0; i--)
+		edges[i] = std::min(edges[i], edges[i + 1] - min_width);
+
+	for (int i = 0; i < regioncount; i++) {
+		regions[i].x = edges[i];
+		regions[i].w = edges[i + 1] - edges[i];
+		region_groups[i % region_group_count][i / region_group_count] = regions[i];
+		task_regions[i] = regions[i];
+	}
+	limit_strip_moves();
+}
+
+// Sums the participant counters into last_stats, the caller adds the chunk sweep
+void reduce_stats() {
+	for (int t = 0; t < TYPE_COUNT; t++)
+		last_stats.particles[t] = 0;
+	last_stats.moves = 0;
+	last_stats.failed_moves = 0;
+	last_stats.collisions = 0;
+	last_stats.cells_skipped = 0;
+
+	for (int i = 0; i < threadcount; i++) {
+		thread_stats & stats = participant_stats[i];
+		for (int t = 0; t < TYPE_COUNT; t++)
+			last_stats.particles[t] += stats.particles[t];
+		last_stats.moves += stats.moves;
+		last_stats.failed_moves += stats.failed_moves;
+		last_stats.collisions += stats.collisions;
+		last_stats.cells_skipped += stats.cells_skipped;
+	}
+}
+
+const step_stats & simulate(atom_field * parts) {
+    /*region_bounds region;
+	region.x = 0;
+	region.y = 0;
+	region.w = world_width;
+	region.h = world_height;
+	simulate_region(parts, region, mutex);*/
+
+	trace_scope step_scope("step", (int64_t)simulation_step);
+	{
+		trace_scope scope("edits");
+		apply_edits(parts);
+	}
+	// The blocks of a split world would straddle the bands
+	block_types = atom_engine == ENGINE_BLOCKS && band_y0 == 0 && band_y1 == world_height ? block_mover_mask() : 0;
+
+	typedef std::chrono::steady_clock clock;
+	int phasecount = (int)last_stats.phase_ms.size();
+	phase_marks.resize(phasecount + 1);
+	phase_marks[0] = clock::now();
+
+	// The halo exchanges of a split world need every tile of a colour done
+	if (task_scheduling && !tile_colour_done) {
+		run_step_tasks(parts);
+	}
+	else if (scheduler == SCHEDULER_TILES) {
+		for (int colour = 0; colour < TILE_COLOURS; colour++)
+			tile_cursor[colour].store(0, std::memory_order_relaxed);
+
+		pool->run([parts](int threadid) {
+			thread_stats & stats = participant_stats[threadid];
+			memset(&stats, 0, sizeof(stats));
+			double busy = 0.0;
+			int tile_offset = 0;
+			for (int colour = 0; colour < TILE_COLOURS; colour++) {
+				if (colour) {
+					wait_phase();
+					if (!threadid) {
+						if (tile_colour_done)
+							tile_colour_done(parts, colour - 1);
+						phase_marks[colour] = clock::now();
+					}
+					if (tile_colour_done)
+						wait_phase();
+				}
+				int tile;
+				while ((tile = tile_cursor[colour].fetch_add(1, std::memory_order_relaxed)) < (int)tiles[colour].size()) {
+					clock::time_point start = clock::now();
+					{
+						trace_scope scope("tile", tile_offset + tile, true);
+						simulate_region(parts, tiles[colour][tile], mutex, stats);
+					}
+					double region_time = elapsed_ms(start, clock::now());
+					last_stats.region_ms[tile_offset + tile] = region_time;
+					busy += region_time;
+				}
+				tile_offset += (int)tiles[colour].size();
+			}
+			last_stats.thread_ms[threadid] = busy;
+		});
+		if (tile_colour_done)
+			tile_colour_done(parts, TILE_COLOURS - 1);
+	}
+	else {
+		// Every participant runs its region of each group, groups are separated by a barrier
+		pool->run([parts](int threadid) {
+			thread_stats & stats = participant_stats[threadid];
+			memset(&stats, 0, sizeof(stats));
+			double busy = 0.0;
+			for (int j = 0; j < region_group_count; j++) {
+				if (j) {
+					wait_phase();
+					if (!threadid)
+						phase_marks[j] = clock::now();
+				}
+				clock::time_point start = clock::now();
+				{
+					trace_scope scope("region", threadid * region_group_count + j, true);
+					simulate_region(parts, region_groups[j][threadid], mutex, stats);
+				}
+				double region_time = elapsed_ms(start, clock::now());
+				last_stats.region_ms[threadid * region_group_count + j] = region_time;
+				busy += region_time;
+			}
+			last_stats.thread_ms[threadid] = busy;
+		});
+	}
+	phase_marks[phasecount] = clock::now();
+	// Phases with no tasks keep the mark of an earlier step
+	for (int i = 1; i < phasecount; i++)
+		phase_marks[i] = std::max(phase_marks[i], phase_marks[i - 1]);
+
+	if (block_types) {
+		trace_scope scope("blocks");
+		step_blocks(parts);
+	}
+
+	// Chunks are only put to sleep afterwards, the air needs to know which were active
+	clock::time_point air_start = clock::now();
+	if (air_enabled) {
+		trace_scope scope("air");
+		step_air(parts);
+	}
+	clock::time_point step_end = clock::now();
+	last_stats.air_ms = elapsed_ms(air_start, step_end);
+
+	if (scheduler == SCHEDULER_STRIPS && balance_regions) {
+		trace_scope scope("balance");
+		measure_columns(parts);
+		balance_strips();
+	}
+
+	reduce_stats();
+	{
+		trace_scope scope("chunks");
+		update_chunks(parts);
+	}
+	last_stats.pages = parts->pagecount.load(std::memory_order_relaxed);
+
+	last_stats.partcount = 0;
+	for (int t = TYPE_NONE + 1; t < TYPE_COUNT; t++)
+		last_stats.partcount += last_stats.particles[t];
+	for (int i = 0; i < phasecount; i++) {
+		last_stats.phase_ms[i] = elapsed_ms(phase_marks[i], phase_marks[i + 1]);
+		trace_complete(scheduler == SCHEDULER_TILES ? "colour" : "group", phase_marks[i], phase_marks[i + 1], i);
+	}
+	last_stats.step_ms = elapsed_ms(phase_marks[0], step_end);
+
+	mutex = !mutex;
+	simulation_step++;
+	step_key = rng_step_key(simulation_seed, simulation_step);
+
+	return last_stats;
+}
+
+void run_participants(std::function<void(int)> job) {
+	if (pool)
+		pool->run(std::move(job));
+	else
+		job(0);
+}
+
+// Sets a cell as an edit does, erasing never allocates a page
+inline void paint_cell(atom_field * parts, int x, int y, uint8_t type, uint64_t edit_key) {
+	if (type == TYPE_NONE && page_at(parts, x, y) == &empty_page)
+		return;
+	atom_page * page = writable_page(parts, x, y);
+	int i = CELL(x, y);
+	page->type[i] = type;
+	set_occupied(parts, x, y, type != TYPE_NONE);
+	mark_dirty(parts, x, y);
+	page->vx[i] = store_velocity(0.0f);
+	page->vy[i] = store_velocity(0.0f);
+	page->x[i] = store_position((float)x, x);
+	page->y[i] = store_position((float)y, y);
+	if (type == TYPE_PARTICLE) {
+		rng_stream rng(edit_key, x, y);
+		page->vx[i] = store_velocity(randfd(rng) * 5.0f);
+		page->vy[i] = store_velocity(randfd(rng) * 5.0f);
+	}
+}
+
+inline region_bounds clip_to_world(region_bounds rect) {
+	int x1 = std::min(rect.x + rect.w, world_width), y1 = std::min(rect.y + rect.h, world_height);
+	rect.x = std::max(rect.x, 0);
+	rect.y = std::max(rect.y, 0);
+	rect.w = std::max(x1 - rect.x, 0);
+	rect.h = std::max(y1 - rect.y, 0);
+	return rect;
+}
+
+// Applies the part of an edit inside rect
+void paint_rect(atom_field * parts, const atom_edit & edit, region_bounds rect, uint64_t edit_key) {
+	for (int y = rect.y; y < rect.y + rect.h; y++) {
+		for (int x = rect.x; x < rect.x + rect.w; x++) {
+			if (edit.kind == EDIT_RETYPE && type_at(parts, x, y) != edit.from)
+				continue;
+			paint_cell(parts, x, y, edit.type, edit_key);
+		}
+	}
+}
+
+// Every cell of an edit only depends on its own position, so the edits can be
+// split up by chunk as long as each chunk applies them in queue order
+inline void wake_edit(atom_field * parts, const atom_edit & edit) {
+	wake_chunk_rect(parts, edit.rect.x - 1, edit.rect.y - 1, edit.rect.x + edit.rect.w, edit.rect.y + edit.rect.h);
+}
+
+void add_parts(atom_field * parts, int origin_x, int origin_y, uint8_t type) {
+	atom_edit edit = brush_edit(origin_x, origin_y, type);
+	wake_edit(parts, edit);
+	paint_rect(parts, edit, clip_to_world(edit.rect), rng_step_key(~simulation_seed, simulation_step));
+}
+
+atom_edit brush_edit(int origin_x, int origin_y, uint8_t type) {
+	region_bounds rect = { origin_x - BRUSH_RADIUS, origin_y - BRUSH_RADIUS, 2 * BRUSH_RADIUS, 2 * BRUSH_RADIUS };
+	return atom_edit{ EDIT_BRUSH, type, TYPE_NONE, rect };
+}
+
+atom_edit fill_edit(region_bounds rect, uint8_t type) {
+	return atom_edit{ EDIT_FILL, type, TYPE_NONE, rect };
+}
+
+atom_edit retype_edit(region_bounds rect, uint8_t from, uint8_t type) {
+	return atom_edit{ EDIT_RETYPE, type, from, rect };
+}
+
+mpsc_queue<atom_edit> edit_queue;
+std::function<void(const atom_edit & edit)> edit_applied;
+// Edits of the current step and the chunks they touch, reused between steps
+std::vector<atom_edit> step_edits;
+std::vector<int> edit_chunks;
+std::vector<uint8_t> edit_chunk_flags;
+
+void queue_edit(const atom_edit & edit) {
+	edit_queue.push(edit);
+}
+
+bool edits_pending() {
+	return !edit_queue.empty();
+}
+
+void apply_edits(atom_field * parts) {
+	step_edits.clear();
+	atom_edit edit;
+	while (edit_queue.pop(edit))
+		step_edits.push_back(edit);
+	if (step_edits.empty())
+		return;
+
+	edit_chunk_flags.resize(chunk_columns * chunk_rows);
+	edit_chunks.clear();
+	for (const atom_edit & edit : step_edits) {
+		wake_edit(parts, edit);
+		region_bounds rect = clip_to_world(edit.rect);
+		for (int chunk_y = rect.y / CHUNK_SIZE; rect.w && chunk_y * CHUNK_SIZE < rect.y + rect.h; chunk_y++) {
+			for (int chunk_x = rect.x / CHUNK_SIZE; chunk_x * CHUNK_SIZE < rect.x + rect.w; chunk_x++) {
+				int chunk = chunk_x + chunk_y * chunk_columns;
+				if (!edit_chunk_flags[chunk]) {
+					edit_chunk_flags[chunk] = 1;
+					edit_chunks.push_back(chunk);
+				}
+			}
+		}
+		if (edit_applied)
+			edit_applied(edit);
+	}
+
+	uint64_t edit_key = rng_step_key(~simulation_seed, simulation_step);
+	std::atomic<size_t> cursor(0);
+	run_participants([parts, edit_key, &cursor](int) {
+		size_t next;
+		while ((next = cursor.fetch_add(1, std::memory_order_relaxed)) < edit_chunks.size()) {
+			int chunk = edit_chunks[next];
+			region_bounds bounds = { (chunk % chunk_columns) * CHUNK_SIZE, (chunk / chunk_columns) * CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE };
+			for (const atom_edit & edit : step_edits) {
+				region_bounds rect = clip_to_world(edit.rect);
+				int x0 = std::max(rect.x, bounds.x), y0 = std::max(rect.y, bounds.y);
+				int x1 = std::min(rect.x + rect.w, bounds.x + bounds.w), y1 = std::min(rect.y + rect.h, bounds.y + bounds.h);
+				if (x0 < x1 && y0 < y1)
+					paint_rect(parts, edit, region_bounds{ x0, y0, x1 - x0, y1 - y0 }, edit_key);
+			}
+		}
+	});
+
+	for (int chunk : edit_chunks)
+		edit_chunk_flags[chunk] = 0;
+}
+
+const uint32_t type_colours[TYPE_COUNT] = {
+	0x00000000,	// TYPE_NONE
+	0x00FF0000,	// TYPE_SOLID
+	0x0000FF00,	// TYPE_POWDER
+	0x000000FF,	// TYPE_LIQUID
+	0x00FFFF00,	// TYPE_GAS
+	0x00FF00FF	// TYPE_PARTICLE
+};
+
+void copy_types(atom_field * parts, region_bounds rect, uint8_t * plane) {
+	for (int y = rect.y; y < rect.y + rect.h; y++)
+		copy_row(parts, rect.x, y, rect.w, plane + PART(rect.x, y));
+}
+
+void collect_dirty_chunks(atom_field * parts, std::vector<uint8_t> & flags) {
+	flags.resize(chunk_columns * chunk_rows, 0);
+	for (int i = 0; i < chunk_columns * chunk_rows; i++) {
+		if (parts->chunks[i].dirty.exchange(false, std::memory_order_relaxed))
+			flags[i] = 1;
+	}
+}
+
+void chunk_rects(const std::vector<uint8_t> & flags, std::vector<region_bounds> & rects) {
+	rects.clear();
+	for (int chunk_y = 0; chunk_y < chunk_rows; chunk_y++) {
+		int run_start = -1;
+		for (int chunk_x = 0; chunk_x <= chunk_columns; chunk_x++) {
+			bool dirty = chunk_x < chunk_columns && flags[chunk_x + chunk_y * chunk_columns];
+			if (dirty && run_start < 0)
+				run_start = chunk_x;
+			if (!dirty && run_start >= 0) {
+				region_bounds rect;
+				rect.x = run_start * CHUNK_SIZE;
+				rect.y = chunk_y * CHUNK_SIZE;
+				rect.w = std::min(chunk_x * CHUNK_SIZE, world_width) - rect.x;
+				rect.h = std::min(CHUNK_SIZE, world_height - rect.y);
+				rects.push_back(rect);
+				run_start = -1;
+			}
+		}
+	}
+}
+
+void collect_dirty_rects(atom_field * parts, std::vector<region_bounds> & rects) {
+	static thread_local std::vector<uint8_t> flags;
+	flags.assign(chunk_columns * chunk_rows, 0);
+	collect_dirty_chunks(parts, flags);
+	chunk_rects(flags, rects);
+}
+
+void draw(atom_field * parts, uint32_t * vid) {
+	trace_scope scope("draw");
+	std::fill(vid, vid + (WINDOWW * WINDOWH), 0);
+	int width = std::min(world_width, WINDOWW), height = std::min(world_height, WINDOWH);
+	for (int y = 0; y < height; y++) {
+		for (int x = next_occupied(parts, 0, width, y); x < width; x = next_occupied(parts, x + 1, width, y)) {
+			vid[PIX(x, y)] = type_colours[type_at(parts, x, y)];
+		}
+	}
+}
@@ -0,0 +1,317 @@
+﻿// simulation.h : Simulation core shared by the interactive client and the
+// headless benchmark. Nothing in here may depend on SDL or OpenGL.
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <ostream>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "tpt-prototype.h"
+#include "air.h"
+#include "placement.h"
+
+struct chunk_state {
+	std::atomic<bool> active;			// something moved in or next to the chunk this step
+	uint8_t idle_steps;					// steps since the chunk was last active
+	std::atomic<uint32_t> partcount[TYPE_COUNT];	// particles counted when the chunk was last simulated
+	std::atomic<bool> dirty;			// a type changed since the chunk was last collected for drawing
+};
+
+// World size in cells and in chunks, set by create_atom_field. Only one world
+// exists at a time.
+extern int world_width;
+extern int world_height;
+extern int chunk_columns;
+extern int chunk_rows;
+extern int bitplane_stride;
+
+// Atom state is stored as floats with absolute positions by default. Building
+// with TPT_COMPACT_ATOMS stores velocities as 8.8 fixed point and positions as
+// 8 bit offsets from the cell centre, 7 instead of 17 bytes per cell. The
+// arithmetic stays in float and values are rounded to nearest when stored, so
+// compact runs differ from float runs but not between kernels or compilers.
+#ifdef TPT_COMPACT_ATOMS
+typedef int16_t atom_velocity;
+typedef int8_t atom_position;
+
+#define VELOCITY_ONE 256.0f
+#define OFFSET_ONE 256.0f
+
+inline float load_velocity(atom_velocity v) {
+	return v * (1.0f / VELOCITY_ONE);
+}
+
+inline atom_velocity store_velocity(float v) {
+	return (atom_velocity)lrintf(std::min(std::max(v * VELOCITY_ONE, -32768.0f), 32767.0f));
+}
+
+// Positions always lie within half a cell of the cell holding the atom
+inline float load_position(atom_position p, int cell) {
+	return cell + p * (1.0f / OFFSET_ONE);
+}
+
+inline atom_position store_position(float p, int cell) {
+	return (atom_position)std::min(std::max(lrintf((p - cell) * OFFSET_ONE), -128L), 127L);
+}
+#else
+typedef float atom_velocity;
+typedef float atom_position;
+
+inline float load_velocity(atom_velocity v) {
+	return v;
+}
+
+inline atom_velocity store_velocity(float v) {
+	return v;
+}
+
+inline float load_position(atom_position p, int) {
+	return p;
+}
+
+inline atom_position store_position(float p, int) {
+	return p;
+}
+#endif
+
+// Structure-of-arrays atom storage for one chunk, every plane is indexed with
+// CELL(x, y). Planes read in batches are followed by PLANE_PADDING spare cells
+// so a whole row can be read from any cell of the last one.
+#define PLANE_PADDING CHUNK_SIZE
+
+struct atom_page {
+	uint8_t type[CHUNK_CELLS + PLANE_PADDING];
+	atom_velocity vx[CHUNK_CELLS + PLANE_PADDING];
+	atom_velocity vy[CHUNK_CELLS + PLANE_PADDING];
+	atom_position x[CHUNK_CELLS];
+	atom_position y[CHUNK_CELLS];
+};
+
+// The page table has an entry per chunk. Chunks without atoms share the
+// read-only empty_page, a page is allocated by the first write into its chunk
+// and freed once the chunk empties out, so memory follows the occupied area.
+// The processed flags and the occupancy live in bitplanes over the whole
+// world indexed with BIT(x, y).
+struct atom_field {
+	std::atomic<atom_page *> * pages;
+	std::atomic<uint64_t> * mutex;
+	std::atomic<uint64_t> * occupied;	// type != TYPE_NONE, lets loops skip empty space
+	chunk_state * chunks;
+	std::atomic<int> pagecount;			// pages allocated
+	air_field air;
+};
+
+extern atom_page empty_page;
+
+// Index of the lowest set bit, bits may not be 0
+inline int count_trailing_zeros(uint64_t bits) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return (int)index;
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+inline atom_page * page_at(const atom_field * parts, int x, int y) {
+	return parts->pages[CHUNK(x, y)].load(std::memory_order_acquire);
+}
+
+inline uint8_t type_at(const atom_field * parts, int x, int y) {
+	return page_at(parts, x, y)->type[CELL(x, y)];
+}
+
+struct region_bounds {
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
+// Counters of one participant, padded so that no two share a cache line
+struct thread_stats {
+	char padding_front[64];
+	uint32_t particles[TYPE_COUNT];
+	uint64_t moves;
+	uint64_t failed_moves;
+	uint64_t collisions;
+	uint64_t cells_skipped;
+	char padding_back[64];
+};
+
+// Statistics of the last step, reduced from the per-participant counters
+struct step_stats {
+	uint32_t particles[TYPE_COUNT];	// occupied cells by type, including sleeping chunks
+	uint32_t partcount;
+	uint64_t moves;					// successful do_move calls
+	uint64_t failed_moves;
+	uint64_t collisions;			// collision fallbacks taken after a blocked move
+	uint64_t cells_skipped;			// cells in sleeping chunks
+	uint32_t pages;					// atom pages allocated after the step
+	double step_ms;
+	double air_ms;					// part of the step spent solving the air
+	std::vector<double> phase_ms;	// wall time of each region group or tile colour
+	std::vector<double> region_ms;	// time spent in each region or tile
+	std::vector<double> thread_ms;	// time each participant spent simulating
+};
+
+// Atom pages are carved out of slabs of PAGE_SLAB_SIZE, each NUMA node has
+// slabs of its own and a page comes from the node of the thread that
+// allocates it, which is the thread simulating the chunk.
+#define PAGE_SLAB_SIZE HUGE_PAGE_SIZE
+
+// Sizes the world, any previous field has to be destroyed first
+atom_field * create_atom_field(int width, int height);
+void clear_atom_field(atom_field * parts);
+void destroy_atom_field(atom_field * parts);
+uint64_t hash_atom_field(atom_field * parts);
+
+enum scheduler_mode {
+	SCHEDULER_STRIPS,	// full height strips alternating between region groups
+	SCHEDULER_TILES		// 2D tiles run in four checkerboard colour phases
+};
+
+// Scheduler settings, picked up by init_simulation and reinit_simulation
+extern scheduler_mode scheduler;
+// Participant 0 is the thread calling init_simulation and is pinned as well
+extern pin_mode thread_pinning;
+extern std::vector<int> pinned_cores;
+extern int tile_width;
+extern int tile_height;
+
+// Runs every region or tile as soon as the neighbours it follows are done
+// instead of waiting for the whole previous group or colour, on by default.
+// Gives the same results as the barriers. Split worlds always use the
+// barriers, their halo exchanges run between the colours.
+extern bool task_scheduling;
+
+// Smaller tile sizes are raised to this
+#define TILE_MIN_SIZE 8
+
+// Moves the strip boundaries between steps so that every region holds about
+// the same amount of work, on by default. Regions never get narrower than
+// REGION_MIN_WIDTH, which keeps the regions of a group apart.
+extern bool balance_regions;
+#define REGION_MIN_WIDTH CHUNK_SIZE
+
+// Furthest a single step may move an atom, half a tile or half the narrowest
+// strip when several participants run at once
+extern float move_limit;
+
+// Rows simulated by this process, the whole world unless it is split across
+// processes (distributed.h). A partial band forces the tile scheduler and has
+// to start and end on a tile row.
+extern int band_y0;
+extern int band_y1;
+// Runs on participant 0 after each tile colour while the others wait
+extern void (*tile_colour_done)(atom_field * parts, int colour);
+// Runs on participant 0 once the pushes of a step are added to the air and
+// before it is solved, while the others wait
+extern void (*air_pushes_done)(atom_field * parts);
+
+// Solves the air every step and couples it to the atoms, on by default.
+// Switching it off leaves the air as it is.
+extern bool air_enabled;
+// Closes the air cells holding enough solid cells and opens the others. Steps
+// only do this for the chunks that were active, loading a world does it for
+// all of them.
+void block_air(atom_field * parts);
+
+enum movement_engine {
+	ENGINE_ATOMS,	// every atom follows its velocity
+	ENGINE_BLOCKS	// powder and liquid follow the block rule of blocks.h
+};
+
+// Engine used from the next step on, ENGINE_ATOMS by default. With blocks the
+// other types move first and powder and liquid are rearranged afterwards.
+// A split world always moves every atom by its velocity.
+extern movement_engine atom_engine;
+
+// Random numbers are derived from (seed, step, cell), so with the tile
+// scheduler the state after N steps does not depend on the thread count.
+// deterministic forces the tile scheduler in init_simulation.
+extern uint64_t simulation_seed;
+extern uint64_t simulation_step;
+extern bool deterministic;
+
+// Sets the seed and rewinds the step counter
+void seed_simulation(uint64_t seed);
+// Value the processed flags are set to by the next step, it flips every step
+bool processed_flag();
+// Continues a run at the given step, used when restoring a snapshot
+void resume_simulation(uint64_t seed, uint64_t step, bool processed);
+
+// Where init_simulation reports the configured pools, std::cout by default.
+extern std::ostream * simulation_log;
+
+void init_simulation(int threadcount_, int groupcount_);
+void shutdown_simulation();
+void reinit_simulation(int threadcount_, int groupcount_);
+const step_stats & simulate(atom_field * parts);
+// Runs job on every participant of the simulation pool, or on the caller
+// alone before init_simulation
+void run_participants(std::function<void(int)> job);
+
+// Page of the chunk holding (x, y), allocated if the chunk has none yet
+atom_page * writable_page(atom_field * parts, int x, int y);
+// Only between steps, nothing may hold on to the page
+void free_page(atom_field * parts, int chunk);
+
+// Stamps a square of 2 * BRUSH_RADIUS cells centred on the origin right away,
+// only while nothing else uses the field
+#define BRUSH_RADIUS 10
+void add_parts(atom_field * parts, int origin_x, int origin_y, uint8_t type);
+
+enum edit_kind {
+	EDIT_BRUSH,		// add_parts at the centre of rect
+	EDIT_FILL,		// every cell of rect, TYPE_NONE clears
+	EDIT_RETYPE		// cells of rect holding type from
+};
+
+struct atom_edit {
+	edit_kind kind;
+	uint8_t type;
+	uint8_t from;
+	region_bounds rect;	// may reach past the world
+};
+
+atom_edit brush_edit(int origin_x, int origin_y, uint8_t type);
+atom_edit fill_edit(region_bounds rect, uint8_t type);
+atom_edit retype_edit(region_bounds rect, uint8_t from, uint8_t type);
+
+// Edits can be queued from any thread without locking and are applied in
+// queue order at the start of the next step, the participants splitting the
+// chunks they touch between them
+void queue_edit(const atom_edit & edit);
+// Applies the queued edits now, on the thread that runs the steps and only
+// between them. simulate() calls it first thing.
+void apply_edits(atom_field * parts);
+// Edits queued but not applied yet, from the thread that runs the steps
+bool edits_pending();
+// Called for every edit as it is applied, in queue order
+extern std::function<void(const atom_edit & edit)> edit_applied;
+
+// Colour of every type, 0x00BBGGRR as uploaded to GL_RGBA textures
+extern const uint32_t type_colours[TYPE_COUNT];
+
+// Copies the types of a rectangle into a row-major plane of the world size
+void copy_types(atom_field * parts, region_bounds rect, uint8_t * plane);
+
+// Sets flags[CHUNK(x, y)] for every chunk whose types changed since the last
+// collection and clears the dirty flags. Flags already set are kept.
+void collect_dirty_chunks(atom_field * parts, std::vector<uint8_t> & flags);
+// Rectangles covering the flagged chunks, horizontal runs are merged
+void chunk_rects(const std::vector<uint8_t> & flags, std::vector<region_bounds> & rects);
+// Both of the above in one go
+void collect_dirty_rects(atom_field * parts, std::vector<region_bounds> & rects);
+void draw(atom_field * parts, uint32_t * vid);
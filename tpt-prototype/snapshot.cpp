@@ -0,0 +1,407 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "snapshot.h"
+
+static_assert(sizeof(snapshot_header) == 48 && sizeof(snapshot_chunk) == 40, "snapshot layout changed");
+// The processed flags of a chunk row are copied as one 32 bit mask
+static_assert(CHUNK_SIZE == 32, "snapshot blocks assume 32 cell chunk rows");
+
+// Chunks claimed at once by a participant while loading
+#define LOAD_BATCH 16
+
+// Read-only mapping of a whole file
+class mapped_file {
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int descriptor = -1;
+#endif
+public:
+	const uint8_t * data = nullptr;
+	size_t size = 0;
+
+	bool open(const char * path) {
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER length;
+		if (!GetFileSizeEx(file, &length) || length.QuadPart == 0)
+			return false;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping)
+			return false;
+		data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		size = (size_t)length.QuadPart;
+#else
+		descriptor = ::open(path, O_RDONLY);
+		if (descriptor < 0)
+			return false;
+		struct stat status;
+		if (fstat(descriptor, &status) || status.st_size == 0)
+			return false;
+		void * mapped = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		if (mapped == MAP_FAILED)
+			return false;
+		data = (const uint8_t *)mapped;
+		size = (size_t)status.st_size;
+#ifdef MADV_WILLNEED
+		madvise(mapped, size, MADV_WILLNEED);
+#endif
+#endif
+		return data != nullptr;
+	}
+
+	~mapped_file() {
+#ifdef _WIN32
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+#else
+		if (data)
+			munmap((void *)data, size);
+		if (descriptor >= 0)
+			close(descriptor);
+#endif
+	}
+};
+
+// Columns of the chunk starting at x that lie inside the world
+inline uint32_t column_mask(int x) {
+	int columns = std::min(CHUNK_SIZE, world_width - x);
+	return columns == 32 ? ~uint32_t(0) : (uint32_t(1) << columns) - 1;
+}
+
+inline uint32_t row_bits(const std::atomic<uint64_t> * plane, int x, int y) {
+	return (uint32_t)(plane[BIT(x, y)].load(std::memory_order_relaxed) >> (x & 63));
+}
+
+// Two chunks share a bitplane word, so rows are merged in atomically
+inline void merge_row_bits(std::atomic<uint64_t> * plane, int x, int y, uint32_t bits) {
+	if (bits)
+		plane[BIT(x, y)].fetch_or((uint64_t)bits << (x & 63), std::memory_order_relaxed);
+}
+
+template<typename T>
+inline void append(std::vector<uint8_t> & out, const T * values, size_t count) {
+	const uint8_t * bytes = (const uint8_t *)values;
+	out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+// Appends the block of a chunk to out unless the chunk can be described by
+// its directory entry alone
+void encode_chunk(atom_field * parts, int chunk, std::vector<uint8_t> & out, snapshot_chunk & entry) {
+	int x = (chunk % chunk_columns) * CHUNK_SIZE;
+	int y0 = (chunk / chunk_columns) * CHUNK_SIZE;
+	int rows = std::min(CHUNK_SIZE, world_height - y0);
+	uint32_t columns = column_mask(x);
+
+	uint32_t processed[CHUNK_SIZE] = {};
+	bool all_set = true, all_clear = true;
+	for (int r = 0; r < rows; r++) {
+		processed[r] = row_bits(parts->mutex, x, y0 + r) & columns;
+		all_set &= processed[r] == columns;
+		all_clear &= processed[r] == 0;
+	}
+
+	const atom_page * page = parts->pages[chunk].load(std::memory_order_relaxed);
+	if (page == &empty_page && (all_set || all_clear)) {
+		entry.flags = all_set ? SNAPSHOT_CHUNK_PROCESSED : 0;
+		return;
+	}
+
+	for (int i = 0; i < CHUNK_CELLS;) {
+		int run = 1;
+		while (run < 256 && i + run < CHUNK_CELLS && page->type[i + run] == page->type[i])
+			run++;
+		out.push_back((uint8_t)(run - 1));
+		out.push_back(page->type[i]);
+		i += run;
+	}
+	append(out, processed, CHUNK_SIZE);
+
+	int occupied[CHUNK_CELLS];
+	int count = 0;
+	for (int i = 0; i < CHUNK_CELLS; i++) {
+		if (page->type[i] != TYPE_NONE)
+			occupied[count++] = i;
+	}
+	for (int j = 0; j < count; j++) {
+		float v = load_velocity(page->vx[occupied[j]]);
+		append(out, &v, 1);
+	}
+	for (int j = 0; j < count; j++) {
+		float v = load_velocity(page->vy[occupied[j]]);
+		append(out, &v, 1);
+	}
+	for (int j = 0; j < count; j++) {
+		float p = load_position(page->x[occupied[j]], x + occupied[j] % CHUNK_SIZE);
+		append(out, &p, 1);
+	}
+	for (int j = 0; j < count; j++) {
+		float p = load_position(page->y[occupied[j]], y0 + occupied[j] / CHUNK_SIZE);
+		append(out, &p, 1);
+	}
+}
+
+// Restores one chunk into a cleared field, false if its block is damaged
+bool decode_chunk(atom_field * parts, int chunk, const snapshot_chunk & entry, const mapped_file & file) {
+	int x = (chunk % chunk_columns) * CHUNK_SIZE;
+	int y0 = (chunk / chunk_columns) * CHUNK_SIZE;
+	int rows = std::min(CHUNK_SIZE, world_height - y0);
+	uint32_t columns = column_mask(x);
+
+	chunk_state & state = parts->chunks[chunk];
+	state.idle_steps = entry.idle_steps;
+	state.active.store(entry.active != 0, std::memory_order_relaxed);
+	for (int t = 0; t < TYPE_COUNT; t++)
+		state.partcount[t].store(entry.partcount[t], std::memory_order_relaxed);
+
+	if (!entry.size) {
+		if (entry.flags & SNAPSHOT_CHUNK_PROCESSED)
+			for (int r = 0; r < rows; r++)
+				merge_row_bits(parts->mutex, x, y0 + r, columns);
+		return true;
+	}
+	if (entry.offset > file.size || entry.size > file.size - entry.offset)
+		return false;
+	const uint8_t * data = file.data + entry.offset;
+	const uint8_t * end = data + entry.size;
+
+	uint8_t types[CHUNK_CELLS];
+	int count = 0;
+	for (int i = 0; i < CHUNK_CELLS;) {
+		if (end - data < 2)
+			return false;
+		int run = data[0] + 1;
+		uint8_t type = data[1];
+		data += 2;
+		if (type >= TYPE_COUNT || run > CHUNK_CELLS - i)
+			return false;
+		memset(types + i, type, run);
+		if (type != TYPE_NONE) {
+			// Atoms may not lie outside the world
+			for (int cell = i; cell < i + run; cell++)
+				if (!(columns >> (cell % CHUNK_SIZE) & 1) || cell / CHUNK_SIZE >= rows)
+					return false;
+			count += run;
+		}
+		i += run;
+	}
+
+	uint32_t processed[CHUNK_SIZE];
+	if ((size_t)(end - data) != sizeof(processed) + count * 4 * sizeof(float))
+		return false;
+	memcpy(processed, data, sizeof(processed));
+	data += sizeof(processed);
+	for (int r = 0; r < rows; r++)
+		merge_row_bits(parts->mutex, x, y0 + r, processed[r] & columns);
+
+	if (!count)
+		return true;
+
+	atom_page * page = writable_page(parts, x, y0);
+	memcpy(page->type, types, CHUNK_CELLS);
+	// Planes are always stored as floats, compact layouts quantize on load
+	for (int plane = 0; plane < 4; plane++) {
+		for (int i = 0; i < CHUNK_CELLS; i++) {
+			if (types[i] == TYPE_NONE)
+				continue;
+			float value;
+			memcpy(&value, data, sizeof(float));
+			data += sizeof(float);
+			switch (plane) {
+			case 0: page->vx[i] = store_velocity(value); break;
+			case 1: page->vy[i] = store_velocity(value); break;
+			case 2: page->x[i] = store_position(value, x + i % CHUNK_SIZE); break;
+			case 3: page->y[i] = store_position(value, y0 + i / CHUNK_SIZE); break;
+			}
+		}
+	}
+
+	for (int r = 0; r < rows; r++) {
+		uint32_t bits = 0;
+		for (int c = 0; c < CHUNK_SIZE; c++)
+			bits |= uint32_t(types[r * CHUNK_SIZE + c] != TYPE_NONE) << c;
+		merge_row_bits(parts->occupied, x, y0 + r, bits);
+	}
+	return true;
+}
+
+inline size_t air_plane_size(const air_field & air) {
+	return (size_t)air.width * air.height;
+}
+
+// The last solved air without the padding
+void encode_air(const air_field & air, std::vector<float> & out) {
+	const float * planes[3] = { air.pressure[air.current], air.vx[air.current], air.vy[air.current] };
+	for (const float * plane : planes)
+		for (int y = 0; y < air.height; y++)
+			out.insert(out.end(), plane + air_index(air, 0, y), plane + air_index(air, air.width, y));
+}
+
+void decode_air(air_field & air, const float * data) {
+	float * planes[3] = { air.pressure[air.current], air.vx[air.current], air.vy[air.current] };
+	for (float * plane : planes)
+		for (int y = 0; y < air.height; y++) {
+			memcpy(plane + air_index(air, 0, y), data, air.width * sizeof(float));
+			data += air.width;
+		}
+}
+
+bool save_snapshot(atom_field * parts, const char * path) {
+	int chunkcount = chunk_columns * chunk_rows;
+
+	snapshot_header header = {};
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.width = world_width;
+	header.height = world_height;
+	header.chunk_size = CHUNK_SIZE;
+	header.type_count = TYPE_COUNT;
+	header.seed = simulation_seed;
+	header.step = simulation_step;
+	header.processed = processed_flag();
+
+	std::vector<snapshot_chunk> directory(chunkcount);
+	std::vector<uint8_t> blocks;
+	std::vector<float> air_planes;
+	encode_air(parts->air, air_planes);
+	uint64_t base = sizeof(header) + chunkcount * sizeof(snapshot_chunk) + air_planes.size() * sizeof(float);
+	for (int i = 0; i < chunkcount; i++) {
+		snapshot_chunk & entry = directory[i];
+		memset(&entry, 0, sizeof(entry));
+		const chunk_state & state = parts->chunks[i];
+		entry.idle_steps = state.idle_steps;
+		entry.active = state.active.load(std::memory_order_relaxed);
+		for (int t = 0; t < TYPE_COUNT; t++)
+			entry.partcount[t] = state.partcount[t].load(std::memory_order_relaxed);
+
+		size_t start = blocks.size();
+		encode_chunk(parts, i, blocks, entry);
+		if (blocks.size() > start) {
+			entry.offset = base + start;
+			entry.size = (uint32_t)(blocks.size() - start);
+		}
+	}
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write((const char *)&header, sizeof(header));
+	file.write((const char *)directory.data(), directory.size() * sizeof(snapshot_chunk));
+	file.write((const char *)air_planes.data(), air_planes.size() * sizeof(float));
+	file.write((const char *)blocks.data(), blocks.size());
+	return file.good();
+}
+
+// Header of a mapped snapshot, nullptr if the file is not one this build reads
+const snapshot_header * read_header(const mapped_file & file) {
+	if (file.size < sizeof(snapshot_header))
+		return nullptr;
+	const snapshot_header * header = (const snapshot_header *)file.data;
+	if (header->magic != SNAPSHOT_MAGIC || (header->version != 1 && header->version != SNAPSHOT_VERSION) || header->chunk_size != CHUNK_SIZE || header->type_count != TYPE_COUNT)
+		return nullptr;
+	if (header->width < 3 || header->height < 3)
+		return nullptr;
+	return header;
+}
+
+bool snapshot_size(const char * path, int & width, int & height) {
+	mapped_file file;
+	if (!file.open(path))
+		return false;
+	const snapshot_header * header = read_header(file);
+	if (!header)
+		return false;
+	width = header->width;
+	height = header->height;
+	return true;
+}
+
+bool load_snapshot(atom_field * parts, const char * path) {
+	mapped_file file;
+	if (!file.open(path)) {
+		*simulation_log << "snapshot: could not open " << path << std::endl;
+		return false;
+	}
+	const snapshot_header * header = read_header(file);
+	if (!header) {
+		*simulation_log << "snapshot: " << path << " is not a snapshot of this version" << std::endl;
+		return false;
+	}
+	if (header->width != world_width || header->height != world_height) {
+		*simulation_log << "snapshot: " << path << " is " << header->width << "x" << header->height << ", the world is " << world_width << "x" << world_height << std::endl;
+		return false;
+	}
+	int chunkcount = chunk_columns * chunk_rows;
+	size_t air_size = header->version > 1 ? air_plane_size(parts->air) * 3 * sizeof(float) : 0;
+	if ((file.size - sizeof(snapshot_header)) / sizeof(snapshot_chunk) < (size_t)chunkcount
+		|| file.size - sizeof(snapshot_header) - chunkcount * sizeof(snapshot_chunk) < air_size) {
+		*simulation_log << "snapshot: " << path << " is truncated" << std::endl;
+		return false;
+	}
+
+	// The directory follows the 8 byte aligned header, so entries can be read in place
+	const snapshot_chunk * directory = (const snapshot_chunk *)(file.data + sizeof(snapshot_header));
+
+	clear_atom_field(parts);
+
+	std::atomic<int> cursor(0);
+	std::atomic<bool> damaged(false);
+	run_participants([&](int) {
+		int first;
+		while ((first = cursor.fetch_add(LOAD_BATCH, std::memory_order_relaxed)) < chunkcount) {
+			int last = std::min(first + LOAD_BATCH, chunkcount);
+			for (int i = first; i < last; i++) {
+				if (!decode_chunk(parts, i, directory[i], file))
+					damaged.store(true, std::memory_order_relaxed);
+			}
+		}
+	});
+
+	if (damaged.load()) {
+		clear_atom_field(parts);
+		*simulation_log << "snapshot: " << path << " is damaged" << std::endl;
+		return false;
+	}
+
+	if (air_size)
+		decode_air(parts->air, (const float *)(directory + chunkcount));
+	block_air(parts);
+
+	resume_simulation(header->seed, header->step, header->processed != 0);
+	return true;
+}
@@ -0,0 +1,61 @@
+﻿// snapshot.h : Binary snapshots of the whole simulation state, used for
+// saves and for shipping prebuilt scenes. Loading maps the file and decodes
+// the chunks on the simulation pool.
+
+#pragma once
+
+#include <cstdint>
+
+#include "simulation.h"
+
+// File layout, all values little endian:
+//   snapshot_header
+//   snapshot_chunk for every chunk, row by row
+//   pressure, vx and vy of every air cell, row by row, one float plane each
+//   one block per chunk with data, at the offset its entry gives:
+//     types of the CHUNK_CELLS cells in CELL order as (run length - 1, type) byte pairs
+//     processed flags, a 32 bit mask per row
+//     vx, vy, x and y of the occupied cells in CELL order, one float plane each
+// Velocities and positions are stored raw so a restored run continues bit
+// identical to the saved one. The compact atom layout converts them to floats,
+// which keeps snapshots exchangeable between both layouts. Version 1 had no
+// air, which such snapshots load without.
+#define SNAPSHOT_MAGIC 0x53545054	// "TPTS"
+#define SNAPSHOT_VERSION 2
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t width;
+	int32_t height;
+	uint32_t chunk_size;
+	uint32_t type_count;
+	uint64_t seed;
+	uint64_t step;
+	uint8_t processed;	// processed_flag() of the next step
+	uint8_t padding[7];
+};
+
+// Chunks without a block have no atoms and every processed flag set to
+// SNAPSHOT_CHUNK_PROCESSED
+#define SNAPSHOT_CHUNK_PROCESSED 1
+
+struct snapshot_chunk {
+	uint64_t offset;
+	uint32_t size;		// 0 when the chunk has no block
+	uint8_t idle_steps;
+	uint8_t active;
+	uint8_t flags;
+	uint8_t padding;
+	uint32_t partcount[TYPE_COUNT];
+};
+
+// Only between steps. Returns false if the file could not be written.
+bool save_snapshot(atom_field * parts, const char * path);
+// World size stored in a snapshot, false if the file is not one
+bool snapshot_size(const char * path, int & width, int & height);
+// Replaces the field, whose size has to match the snapshot, and the seed and
+// step of the simulation. Returns false with the reason on simulation_log if
+// the file can not be used, the field is only touched, and then left cleared,
+// when the chunk data turns out to be damaged.
+bool load_snapshot(atom_field * parts, const char * path);
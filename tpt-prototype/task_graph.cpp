@@ -0,0 +1,148 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <chrono>
+
+#include "task_graph.h"
+#include "profiler.h"
+
+void task_graph::clear() {
+	homes.clear();
+	successors.clear();
+	dependencies.clear();
+}
+
+int task_graph::add_task(int home) {
+	homes.push_back(home);
+	successors.emplace_back();
+	dependencies.push_back(0);
+	return (int)homes.size() - 1;
+}
+
+void task_graph::add_edge(int before, int after) {
+	successors[before].push_back(after);
+	dependencies[after]++;
+}
+
+void task_graph::prepare(int participants) {
+	if (queue_count != participants) {
+		queues.reset(new ready_queue[participants]);
+		queue_count = participants;
+	}
+	if (waiting_count != homes.size()) {
+		waiting.reset(new std::atomic<int>[homes.size()]);
+		waiting_count = homes.size();
+	}
+	for (int i = 0; i < queue_count; i++)
+		queues[i].tasks.clear();
+	int ready = 0;
+	// Pushed last to first so that every participant starts on its lowest task
+	for (int task = size() - 1; task >= 0; task--) {
+		waiting[task].store(dependencies[task], std::memory_order_relaxed);
+		if (!dependencies[task]) {
+			queues[homes[task] % queue_count].tasks.push_back(task);
+			ready++;
+		}
+	}
+	remaining.store(size(), std::memory_order_relaxed);
+	queued.store(ready, std::memory_order_relaxed);
+	parked.store(0, std::memory_order_relaxed);
+}
+
+void task_graph::push(int participant, int task) {
+	{
+		std::lock_guard<std::mutex> lock(queues[participant].mutex);
+		queues[participant].tasks.push_back(task);
+	}
+	queued.fetch_add(1);
+	wake_parked(false);
+}
+
+bool task_graph::pop(int participant, int & task) {
+	std::lock_guard<std::mutex> lock(queues[participant].mutex);
+	if (queues[participant].tasks.empty())
+		return false;
+	task = queues[participant].tasks.back();
+	queues[participant].tasks.pop_back();
+	queued.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool task_graph::steal(int participant, int & task) {
+	for (int i = 1; i < queue_count; i++) {
+		ready_queue & victim = queues[(participant + i) % queue_count];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (victim.tasks.empty())
+			continue;
+		task = victim.tasks.front();
+		victim.tasks.pop_front();
+		queued.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+// The counters are sequentially consistent, so either the parking participant
+// sees the new task or the end of the run, or the other side sees it parked
+void task_graph::wait_for_work(int participant) {
+	auto ready = [this] { return queued.load() > 0 || remaining.load() == 0; };
+	if (queues[participant].waiter.spin(ready))
+		return;
+	std::unique_lock<std::mutex> lock(park_mutex);
+	parked.fetch_add(1);
+	park_condition.wait(lock, ready);
+	parked.fetch_sub(1);
+}
+
+void task_graph::wake_parked(bool all) {
+	if (!parked.load())
+		return;
+	std::lock_guard<std::mutex> lock(park_mutex);
+	if (all)
+		park_condition.notify_all();
+	else
+		park_condition.notify_one();
+}
+
+void task_graph::run(int participant, const std::function<void(int task)> & body) {
+	bool idle = false;
+	std::chrono::steady_clock::time_point idle_start;
+	while (remaining.load(std::memory_order_acquire) > 0) {
+		int task;
+		if (!pop(participant, task) && !steal(participant, task)) {
+			if (!idle)
+				idle_start = std::chrono::steady_clock::now();
+			idle = true;
+			wait_for_work(participant);
+			continue;
+		}
+		if (idle)
+			trace_complete("wait", idle_start, std::chrono::steady_clock::now());
+		idle = false;
+
+		body(task);
+
+		// Readied tasks are queued before the count drops, so nobody leaves early
+		for (int next : successors[task])
+			if (waiting[next].fetch_sub(1, std::memory_order_acq_rel) == 1)
+				push(participant, next);
+		if (remaining.fetch_sub(1) == 1)
+			wake_parked(true);
+	}
+	if (idle)
+		trace_complete("wait", idle_start, std::chrono::steady_clock::now());
+}
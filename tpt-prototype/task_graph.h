@@ -0,0 +1,62 @@
+﻿// task_graph.h : Tasks ordered by dependencies and run by the participants
+// of a thread_pool job. Every participant keeps a deque of ready tasks, takes
+// its newest one and steals the oldest one of another participant when it
+// runs dry. Finishing a task readies the tasks that waited for it on the
+// deque of the same participant, so neighbouring work tends to stay together.
+// Participants without work spin for a while and then park until a task is
+// readied or the run is over.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "thread_pool.h"
+
+class task_graph {
+	// Padded so that no two deques share a cache line
+	struct ready_queue {
+		char padding_front[64];
+		std::mutex mutex;
+		std::deque<int> tasks;
+		spin_waiter waiter;			// only used by the participant owning the deque
+		char padding_back[64];
+	};
+
+	std::vector<int> homes;			// participant a task starts on, modulo the participant count
+	std::vector<std::vector<int>> successors;
+	std::vector<int> dependencies;	// tasks each task waits for
+	std::unique_ptr<std::atomic<int>[]> waiting;	// dependencies not finished yet in the current run
+	size_t waiting_count;
+	std::unique_ptr<ready_queue[]> queues;
+	int queue_count;
+	std::atomic<int> remaining;
+	std::atomic<int> queued;		// tasks on all deques
+	std::atomic<int> parked;
+	std::mutex park_mutex;
+	std::condition_variable park_condition;
+
+	void push(int participant, int task);
+	bool pop(int participant, int & task);
+	bool steal(int participant, int & task);
+	void wait_for_work(int participant);
+	void wake_parked(bool all);
+public:
+	task_graph() : waiting_count(0), queue_count(0), remaining(0), queued(0), parked(0) {}
+	void clear();
+	// Returns the index of the new task
+	int add_task(int home);
+	// after only starts once before finished
+	void add_edge(int before, int after);
+	int size() const { return (int)homes.size(); }
+
+	// Arms the graph for the next run, from one thread while no run is going on
+	void prepare(int participants);
+	// Every participant of the pool job calls this, it returns once all tasks ran
+	void run(int participant, const std::function<void(int task)> & body);
+};
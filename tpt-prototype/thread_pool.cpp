@@ -0,0 +1,135 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <string>
+
+#include "thread_pool.h"
+#include "profiler.h"
+
+phase_barrier::phase_barrier(int count_) : generation(0), waiting(0), count(count_) {
+}
+
+void phase_barrier::reset(int count_) {
+	count = count_;
+	waiting.store(0, std::memory_order_relaxed);
+}
+
+void phase_barrier::arrive_and_wait() {
+	static thread_local spin_waiter waiter;
+
+	uint32_t arrived = generation.load(std::memory_order_acquire);
+	if (waiting.fetch_add(1, std::memory_order_acq_rel) + 1 == count) {
+		waiting.store(0, std::memory_order_relaxed);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			generation.fetch_add(1, std::memory_order_release);
+		}
+		condition.notify_all();
+		return;
+	}
+
+	auto released = [&] { return generation.load(std::memory_order_acquire) != arrived; };
+	if (!waiter.spin(released)) {
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, released);
+	}
+}
+
+thread_pool::thread_pool(int threadcount_) : generation(0), remaining(0), active(1) {
+	resize(threadcount_);
+}
+
+thread_pool::~thread_pool() {
+	resize(1);
+}
+
+void thread_pool::worker(int threadid, uint32_t seen) {
+	spin_waiter waiter;
+	name_trace_thread("participant " + std::to_string(threadid));
+	while (true) {
+		auto signalled = [&] { return generation.load(std::memory_order_acquire) != seen; };
+		if (!waiter.spin(signalled)) {
+			std::unique_lock<std::mutex> lock(mutex);
+			work_condition.wait(lock, signalled);
+		}
+
+		// The generation and the job it was published with are read together
+		std::function<void(int)> current;
+		bool leaving;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			seen = generation.load(std::memory_order_relaxed);
+			current = job;
+			leaving = threadid >= active;
+		}
+		if (!leaving && current)
+			current(threadid);
+
+		if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			std::lock_guard<std::mutex> lock(mutex);
+			done_condition.notify_one();
+		}
+		if (leaving)
+			break;
+	}
+}
+
+void thread_pool::wait_done() {
+	auto finished = [&] { return remaining.load(std::memory_order_acquire) == 0; };
+	if (!caller_waiter.spin(finished)) {
+		std::unique_lock<std::mutex> lock(mutex);
+		done_condition.wait(lock, finished);
+	}
+}
+
+void thread_pool::resize(int threadcount_) {
+	threadcount_ = std::max(threadcount_, 1);
+
+	// Wake every worker with an empty job and wait until all of them saw it,
+	// the ones past the new size exit
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		active = threadcount_;
+		job = nullptr;
+		remaining.store((int)threads.size(), std::memory_order_relaxed);
+		generation.fetch_add(1, std::memory_order_release);
+	}
+	work_condition.notify_all();
+	wait_done();
+
+	while ((int)threads.size() > threadcount_ - 1) {
+		threads.back().join();
+		threads.pop_back();
+	}
+	while ((int)threads.size() < threadcount_ - 1) {
+		threads.emplace_back(&thread_pool::worker, this, (int)threads.size() + 1, generation.load(std::memory_order_relaxed));
+	}
+}
+
+void thread_pool::run(std::function<void(int)> job_) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = std::move(job_);
+		remaining.store(active - 1, std::memory_order_relaxed);
+		generation.fetch_add(1, std::memory_order_release);
+	}
+	work_condition.notify_all();
+
+	job(0);
+
+	wait_done();
+}
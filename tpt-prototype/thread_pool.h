@@ -0,0 +1,72 @@
+﻿// thread_pool.h : Parked worker pool and phase barrier used to run the
+// simulation steps.
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Waiters spin for a short, adaptively sized while before parking on a
+// condition variable, so back to back phases stay cheap while idle waiters
+// cost no CPU.
+class spin_waiter {
+	int spin_limit = 256;
+public:
+	template<typename Predicate>
+	bool spin(Predicate ready) {
+		for (int i = 0; i < spin_limit; i++) {
+			if (ready()) {
+				spin_limit = std::min(spin_limit * 2, 4096);
+				return true;
+			}
+			std::this_thread::yield();
+		}
+		spin_limit = std::max(spin_limit / 2, 16);
+		return false;
+	}
+};
+
+// Reusable barrier for count participants, reset only while nobody waits
+class phase_barrier {
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::atomic<uint32_t> generation;
+	std::atomic<int> waiting;
+	int count;
+public:
+	phase_barrier(int count_ = 1);
+	void reset(int count_);
+	void arrive_and_wait();
+};
+
+// Runs a job on every participant, the calling thread being participant 0,
+// and returns once all of them have finished. Workers park between jobs and
+// the pool can be resized in place between runs.
+class thread_pool {
+	std::vector<std::thread> threads;
+	std::function<void(int)> job;
+
+	std::mutex mutex;
+	std::condition_variable work_condition;
+	std::condition_variable done_condition;
+	std::atomic<uint32_t> generation;
+	std::atomic<int> remaining;
+	int active;
+
+	spin_waiter caller_waiter;
+
+	void worker(int threadid, uint32_t seen);
+	// Waits until every worker woken by the last generation is done with it
+	void wait_done();
+public:
+	thread_pool(int threadcount_);
+	~thread_pool();
+	void resize(int threadcount_);
+	int size() const { return active; }
+	void run(std::function<void(int)> job_);
+};
@@ -0,0 +1,746 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "tpt-prototype.h"
+#include "simulation.h"
+#include "integrate.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "distributed.h"
+#include "profiler.h"
+
+// add_parts stamps a 20x20 square centred on its origin
+#define STAMP 20
+
+// Scenes are laid out in the default world size, larger worlds leave the rest empty
+
+void stamp_rect(atom_field * parts, int x0, int y0, int x1, int y1, uint8_t type) {
+	for (int y = y0 + STAMP / 2; y - STAMP / 2 < y1; y += STAMP)
+		for (int x = x0 + STAMP / 2; x - STAMP / 2 < x1; x += STAMP)
+			add_parts(parts, x, y, type);
+}
+
+void build_container(atom_field * parts) {
+	stamp_rect(parts, 20, SIMULATIONH - 60, SIMULATIONW - 20, SIMULATIONH - 40, TYPE_SOLID);
+	stamp_rect(parts, 20, 100, 40, SIMULATIONH - 40, TYPE_SOLID);
+	stamp_rect(parts, SIMULATIONW - 40, 100, SIMULATIONW - 20, SIMULATIONH - 40, TYPE_SOLID);
+}
+
+void build_powder(atom_field * parts) {
+	build_container(parts);
+	stamp_rect(parts, 200, 60, 600, 400, TYPE_POWDER);
+}
+
+void build_liquid(atom_field * parts) {
+	build_container(parts);
+	stamp_rect(parts, 40, 300, SIMULATIONW - 40, SIMULATIONH - 60, TYPE_LIQUID);
+	stamp_rect(parts, 300, 100, 500, 200, TYPE_LIQUID);
+}
+
+void build_gas(atom_field * parts) {
+	stamp_rect(parts, 200, 150, 600, 450, TYPE_GAS);
+}
+
+void build_mixed(atom_field * parts) {
+	build_container(parts);
+	stamp_rect(parts, 340, 380, 460, 400, TYPE_SOLID);
+	stamp_rect(parts, 60, 100, 300, 300, TYPE_POWDER);
+	stamp_rect(parts, 500, 100, SIMULATIONW - 60, 400, TYPE_LIQUID);
+	stamp_rect(parts, 300, 200, 500, 300, TYPE_GAS);
+}
+
+// Nearly all the work sits in the left quarter, which static strips give to one region
+void build_skewed(atom_field * parts) {
+	build_container(parts);
+	stamp_rect(parts, 40, 100, 220, SIMULATIONH - 60, TYPE_LIQUID);
+	stamp_rect(parts, 40, 40, 220, 100, TYPE_POWDER);
+}
+
+void build_particles(atom_field * parts) {
+	build_container(parts);
+	for (int y = 120; y < 400; y += 70)
+		for (int x = 100; x < SIMULATIONW - 100; x += 75)
+			add_parts(parts, x, y, TYPE_PARTICLE);
+}
+
+struct bench_scene {
+	std::string name;
+	void (*build)(atom_field * parts);
+	std::string snapshot = {};	// loaded instead of built when set
+	const session_journal * replay = nullptr;	// session replayed with its own settings and length
+};
+
+bench_scene scenes[] = {
+	{ "powder", build_powder },
+	{ "liquid", build_liquid },
+	{ "gas", build_gas },
+	{ "mixed", build_mixed },
+	{ "particles", build_particles },
+	{ "skewed", build_skewed },
+};
+
+struct bench_result {
+	std::string scene;
+	std::string scheduler;
+	std::string kernel;
+	std::string engine;
+	int ranks;
+	int threads;
+	int groups;
+	int steps;
+	double occupied_cells;
+	double ns_per_cell;
+	double steps_per_s;
+	double efficiency;
+	double moves;
+	double imbalance;
+	double pages;
+	double p50_us;
+	double p99_us;
+	double air_us;
+	uint64_t state_hash;
+};
+
+double percentile(std::vector<double> & sorted, double p) {
+	size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// keep_pool ignores the pool changes of a replayed session
+bench_result run_bench(atom_field * parts, const bench_scene & scene, int threads, int groups, int steps, int warmup, uint64_t seed, bool keep_pool) {
+	clear_atom_field(parts);
+	seed_simulation(seed);
+
+	// Replays bring their own settings, which only last for the run
+	const session_journal * replay = scene.replay;
+	scheduler_mode bench_scheduler = scheduler;
+	bool bench_deterministic = deterministic;
+	bool bench_air = air_enabled;
+	bool bench_balance = balance_regions;
+	movement_engine bench_engine = atom_engine;
+	int bench_tile_width = tile_width, bench_tile_height = tile_height;
+	if (replay) {
+		replay->restore_settings();
+		steps = replay->length();
+		warmup = 0;
+	}
+
+	// Snapshots are decoded on the pool
+	init_simulation(threads, groups);
+
+	std::string snapshot = replay ? replay->snapshot : scene.snapshot;
+	if (snapshot.size()) {
+		auto load_start = std::chrono::steady_clock::now();
+		if (!load_snapshot(parts, snapshot.c_str()))
+			throw std::runtime_error("could not load " + snapshot);
+		if (!world_rank)
+			std::cerr << "loaded " << snapshot << " in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load_start).count() << " ms" << std::endl;
+	}
+	else if (scene.build) {
+		scene.build(parts);
+	}
+	trim_to_band(parts);
+
+	for (int i = 0; i < warmup; i++)
+		simulate(parts);
+
+	std::vector<double> latencies(steps);
+	double total_ns = 0.0, total_cells = 0.0, total_moves = 0.0, total_imbalance = 0.0, total_pages = 0.0, total_air_ms = 0.0;
+	size_t cursor = 0;
+	for (int i = 0; i < steps; i++) {
+		// Edits are applied outside the timed step
+		if (replay)
+			cursor = replay_events(*replay, cursor, i, threads, groups, keep_pool);
+		auto step_start = std::chrono::steady_clock::now();
+		const step_stats & stats = simulate(parts);
+		auto step_end = std::chrono::steady_clock::now();
+		latencies[i] = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(step_end - step_start).count();
+		total_ns += latencies[i];
+		total_cells += stats.partcount;
+		total_moves += stats.moves;
+		total_pages += stats.pages;
+		total_air_ms += stats.air_ms;
+
+		// Busiest participant over the mean, 1.0 is a perfectly balanced step
+		double busiest = 0.0, busy = 0.0;
+		for (double thread_ms : stats.thread_ms) {
+			busiest = std::max(busiest, thread_ms);
+			busy += thread_ms;
+		}
+		total_imbalance += busy > 0.0 ? busiest * stats.thread_ms.size() / busy : 1.0;
+	}
+
+	shutdown_simulation();
+
+	// Rank 0 reports for the whole world, the step times are its own
+	gather_world(parts);
+	uint64_t state_hash = hash_atom_field(parts);
+	std::vector<double> totals = { total_cells, total_moves, total_pages };
+	reduce_sum(totals);
+	total_cells = totals[0];
+	total_moves = totals[1];
+	total_pages = totals[2];
+
+	std::sort(latencies.begin(), latencies.end());
+
+	bench_result result;
+	result.scene = scene.name;
+	result.scheduler = scheduler == SCHEDULER_TILES ? "tiles" : "strips";
+	result.kernel = kernel_isa_name(kernel);
+	// A split world keeps the atom engine
+	result.engine = atom_engine == ENGINE_BLOCKS && band_y0 == 0 && band_y1 == world_height ? "blocks" : "atoms";
+	result.ranks = world_ranks;
+	result.threads = threads;
+	result.groups = scheduler == SCHEDULER_TILES ? 4 : std::min(groups, threads);
+	result.steps = steps;
+	result.occupied_cells = total_cells / steps;
+	result.ns_per_cell = total_cells > 0.0 ? total_ns / total_cells : 0.0;
+	result.steps_per_s = steps / (total_ns / 1e9);
+	result.efficiency = 1.0;
+	result.moves = total_moves / steps;
+	result.imbalance = total_imbalance / steps;
+	result.pages = total_pages / steps;
+	result.p50_us = percentile(latencies, 0.50) / 1000.0;
+	result.p99_us = percentile(latencies, 0.99) / 1000.0;
+	result.air_us = total_air_ms * 1000.0 / steps;
+	result.state_hash = state_hash;
+
+	if (replay) {
+		// Only the tile scheduler reproduces a session regardless of the pool
+		if (deterministic && !world_rank && state_hash != replay->header.end_hash)
+			std::cerr << "replay of " << scene.name << " diverged from the recorded session" << std::endl;
+		scheduler = bench_scheduler;
+		deterministic = bench_deterministic;
+		air_enabled = bench_air;
+		balance_regions = bench_balance;
+		atom_engine = bench_engine;
+		tile_width = bench_tile_width;
+		tile_height = bench_tile_height;
+	}
+	return result;
+}
+
+std::string hash_string(uint64_t hash) {
+	std::stringstream stream;
+	stream << std::hex << std::setw(16) << std::setfill('0') << hash;
+	return stream.str();
+}
+
+void write_csv(std::ostream & out, std::vector<bench_result> & results) {
+	out << "scene,scheduler,kernel,engine,ranks,threads,groups,steps,occupied_cells,ns_per_cell,steps_per_s,efficiency,moves,imbalance,pages,p50_us,p99_us,air_us,state_hash" << std::endl;
+	for (auto & r : results) {
+		out << r.scene << "," << r.scheduler << "," << r.kernel << "," << r.engine << "," << r.ranks << "," << r.threads << "," << r.groups << "," << r.steps << ","
+			<< std::fixed << std::setprecision(1) << r.occupied_cells << ","
+			<< std::setprecision(3) << r.ns_per_cell << "," << r.steps_per_s << "," << r.efficiency << ","
+			<< r.moves << "," << r.imbalance << "," << std::setprecision(1) << r.pages << "," << std::setprecision(3) << r.p50_us << "," << r.p99_us << "," << r.air_us << "," << hash_string(r.state_hash) << std::endl;
+	}
+}
+
+void write_json(std::ostream & out, std::vector<bench_result> & results) {
+	out << "{\"results\": [" << std::endl;
+	for (size_t i = 0; i < results.size(); i++) {
+		auto & r = results[i];
+		out << "\t{\"scene\": \"" << r.scene << "\", \"scheduler\": \"" << r.scheduler << "\", \"kernel\": \"" << r.kernel << "\", \"engine\": \"" << r.engine << "\", \"ranks\": " << r.ranks << ", \"threads\": " << r.threads << ", \"groups\": " << r.groups
+			<< ", \"steps\": " << r.steps << std::fixed << std::setprecision(3)
+			<< ", \"occupied_cells\": " << r.occupied_cells << ", \"ns_per_cell\": " << r.ns_per_cell
+			<< ", \"steps_per_s\": " << r.steps_per_s << ", \"efficiency\": " << r.efficiency
+			<< ", \"moves\": " << r.moves << ", \"imbalance\": " << r.imbalance << ", \"pages\": " << r.pages
+			<< ", \"p50_us\": " << r.p50_us << ", \"p99_us\": " << r.p99_us << ", \"air_us\": " << r.air_us
+			<< ", \"state_hash\": \"" << hash_string(r.state_hash) << "\"}"
+			<< (i + 1 < results.size() ? "," : "") << std::endl;
+	}
+	out << "]}" << std::endl;
+}
+
+std::vector<int> parse_int_list(const char * arg) {
+	std::vector<int> values;
+	std::stringstream stream(arg);
+	std::string item;
+	while (std::getline(stream, item, ','))
+		values.push_back(std::stoi(item));
+	return values;
+}
+
+void print_usage(const char * name) {
+	std::cerr << "usage: " << name << " [--steps N] [--warmup N] [--threads 1,2,4] [--groups 2,4] [--scheduler strips,tiles] [--kernels scalar,sse41,avx2] [--engine atoms|blocks] [--tile N|WxH] [--size WxH] [--scenes powder,liquid,gas,mixed,particles,skewed] [--load file,...] [--save-scenes dir] [--replay file,...] [--seed N] [--deterministic] [--no-air] [--no-balance] [--barriers] [--pin none|compact|scatter|cores] [--no-huge-pages] [--ranks N] [--rank R] [--transport shm|unix|tcp] [--peers address,...] [--trace file] [--counters] [--format csv|json] [--output file]" << std::endl;
+}
+
+int main(int argc, char * args[])
+{
+	int steps = 500;
+	int warmup = 50;
+	uint64_t seed = 1;
+	std::vector<int> thread_counts;
+	std::vector<int> group_counts = { 2 };
+	std::vector<scheduler_mode> schedulers = { SCHEDULER_STRIPS };
+	std::vector<kernel_isa> kernel_isas = { detect_kernel_isa() };
+	std::vector<std::string> scene_names;
+	std::string format = "csv";
+	std::string output;
+	// Chrome trace of the steps, optionally with hardware counters per region
+	std::string trace_path;
+	bool trace_counters = false;
+	std::vector<std::string> snapshot_paths;
+	std::vector<std::string> replay_paths;
+	bool pool_given = false;
+	std::string save_directory;
+	int width = SIMULATIONW, height = SIMULATIONH;
+	bool sized = false;
+	// Split worlds, without --rank every rank is forked from this process
+	int ranks = 1;
+	int rank = -1;
+	std::string transport_name = "shm";
+	std::vector<std::string> peers;
+
+	int hardware_threads = std::max(1, (int)std::thread::hardware_concurrency());
+	for (int i = 1; i < hardware_threads; i *= 2)
+		thread_counts.push_back(i);
+	thread_counts.push_back(hardware_threads);
+
+	try {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = args[i];
+			if (arg == "--deterministic") {
+				deterministic = true;
+				continue;
+			}
+			if (arg == "--no-air") {
+				air_enabled = false;
+				continue;
+			}
+			if (arg == "--no-balance") {
+				balance_regions = false;
+				continue;
+			}
+			if (arg == "--barriers") {
+				task_scheduling = false;
+				continue;
+			}
+			if (arg == "--counters") {
+				trace_counters = true;
+				continue;
+			}
+			if (arg == "--no-huge-pages") {
+				huge_pages = false;
+				continue;
+			}
+			if (i + 1 >= argc) {
+				print_usage(args[0]);
+				return -1;
+			}
+			if (arg == "--steps")
+				steps = std::stoi(args[++i]);
+			else if (arg == "--warmup")
+				warmup = std::stoi(args[++i]);
+			else if (arg == "--threads") {
+				thread_counts = parse_int_list(args[++i]);
+				pool_given = true;
+			}
+			else if (arg == "--groups") {
+				group_counts = parse_int_list(args[++i]);
+				pool_given = true;
+			}
+			else if (arg == "--seed")
+				seed = std::stoull(args[++i]);
+			else if (arg == "--format")
+				format = args[++i];
+			else if (arg == "--output")
+				output = args[++i];
+			else if (arg == "--trace")
+				trace_path = args[++i];
+			else if (arg == "--pin")
+				thread_pinning = parse_pinning(args[++i], pinned_cores);
+			else if (arg == "--scheduler") {
+				schedulers.clear();
+				std::stringstream stream(args[++i]);
+				std::string item;
+				while (std::getline(stream, item, ',')) {
+					if (item == "strips")
+						schedulers.push_back(SCHEDULER_STRIPS);
+					else if (item == "tiles")
+						schedulers.push_back(SCHEDULER_TILES);
+					else
+						throw std::invalid_argument(item);
+				}
+			}
+			else if (arg == "--engine") {
+				std::string name = args[++i];
+				if (name == "atoms")
+					atom_engine = ENGINE_ATOMS;
+				else if (name == "blocks")
+					atom_engine = ENGINE_BLOCKS;
+				else
+					throw std::invalid_argument(name);
+			}
+			else if (arg == "--kernels") {
+				kernel_isas.clear();
+				std::stringstream stream(args[++i]);
+				std::string item;
+				while (std::getline(stream, item, ',')) {
+					if (item == "scalar")
+						kernel_isas.push_back(KERNEL_SCALAR);
+					else if (item == "sse41")
+						kernel_isas.push_back(KERNEL_SSE41);
+					else if (item == "avx2")
+						kernel_isas.push_back(KERNEL_AVX2);
+					else
+						throw std::invalid_argument(item);
+				}
+			}
+			else if (arg == "--tile") {
+				std::string size = args[++i];
+				size_t separator = size.find('x');
+				tile_width = std::stoi(size.substr(0, separator));
+				tile_height = separator == std::string::npos ? tile_width : std::stoi(size.substr(separator + 1));
+			}
+			else if (arg == "--size") {
+				std::string size = args[++i];
+				size_t separator = size.find('x');
+				width = std::stoi(size.substr(0, separator));
+				height = separator == std::string::npos ? width : std::stoi(size.substr(separator + 1));
+				sized = true;
+			}
+			else if (arg == "--load") {
+				std::stringstream stream(args[++i]);
+				std::string item;
+				while (std::getline(stream, item, ','))
+					snapshot_paths.push_back(item);
+			}
+			else if (arg == "--replay") {
+				std::stringstream stream(args[++i]);
+				std::string item;
+				while (std::getline(stream, item, ','))
+					replay_paths.push_back(item);
+			}
+			else if (arg == "--ranks")
+				ranks = std::stoi(args[++i]);
+			else if (arg == "--rank")
+				rank = std::stoi(args[++i]);
+			else if (arg == "--transport")
+				transport_name = args[++i];
+			else if (arg == "--peers") {
+				std::stringstream stream(args[++i]);
+				std::string item;
+				while (std::getline(stream, item, ','))
+					peers.push_back(item);
+			}
+			else if (arg == "--save-scenes")
+				save_directory = args[++i];
+			else if (arg == "--scenes") {
+				std::stringstream stream(args[++i]);
+				std::string item;
+				while (std::getline(stream, item, ','))
+					scene_names.push_back(item);
+			}
+			else {
+				print_usage(args[0]);
+				return -1;
+			}
+		}
+	}
+	catch (std::exception &) {
+		print_usage(args[0]);
+		return -1;
+	}
+
+	if (steps < 1 || warmup < 0 || width < 3 || height < 3 || (format != "csv" && format != "json") || ranks < 1 || rank >= ranks
+		|| (transport_name != "shm" && transport_name != "unix" && transport_name != "tcp") || (peers.size() && (int)peers.size() != (transport_name == "shm" ? 1 : ranks))) {
+		print_usage(args[0]);
+		return -1;
+	}
+	for (kernel_isa isa : kernel_isas) {
+		if (!kernel_isa_supported(isa)) {
+			std::cerr << "kernel " << kernel_isa_name(isa) << " is not supported here" << std::endl;
+			return -1;
+		}
+	}
+	for (int t : thread_counts) {
+		if (t < 1) {
+			print_usage(args[0]);
+			return -1;
+		}
+	}
+	std::sort(thread_counts.begin(), thread_counts.end());
+	thread_counts.erase(std::unique(thread_counts.begin(), thread_counts.end()), thread_counts.end());
+
+	// Snapshots replace the built in scenes unless those are asked for too
+	std::vector<bench_scene> selected;
+	for (auto & scene : scenes) {
+		if ((scene_names.empty() && snapshot_paths.empty() && replay_paths.empty()) || std::find(scene_names.begin(), scene_names.end(), scene.name) != scene_names.end())
+			selected.push_back(scene);
+	}
+	// Every snapshot has to match the world size, which they set unless --size is given
+	for (auto & path : snapshot_paths) {
+		int snapshot_width, snapshot_height;
+		if (!snapshot_size(path.c_str(), snapshot_width, snapshot_height)) {
+			std::cerr << path << " is not a snapshot" << std::endl;
+			return -1;
+		}
+		if (!sized) {
+			width = snapshot_width;
+			height = snapshot_height;
+			sized = true;
+		}
+		if (snapshot_width != width || snapshot_height != height) {
+			std::cerr << path << " is " << snapshot_width << "x" << snapshot_height << ", the world is " << width << "x" << height << std::endl;
+			return -1;
+		}
+		bench_scene scene;
+		scene.name = path.substr(path.find_last_of("/\\") + 1);
+		scene.build = nullptr;
+		scene.snapshot = path;
+		scene.replay = nullptr;
+		selected.push_back(scene);
+	}
+	// Replays run with the pool of the session unless --threads or --groups is given
+	std::vector<session_journal> journals(replay_paths.size());
+	for (size_t i = 0; i < replay_paths.size(); i++) {
+		const std::string & path = replay_paths[i];
+		session_journal & journal = journals[i];
+		simulation_log = &std::cerr;
+		if (!journal.load(path.c_str()))
+			return -1;
+		if (!journal.length()) {
+			std::cerr << path << " has no steps" << std::endl;
+			return -1;
+		}
+		if (!sized) {
+			width = journal.header.width;
+			height = journal.header.height;
+			sized = true;
+		}
+		if (journal.header.width != width || journal.header.height != height) {
+			std::cerr << path << " is " << journal.header.width << "x" << journal.header.height << ", the world is " << width << "x" << height << std::endl;
+			return -1;
+		}
+		bench_scene scene;
+		scene.name = path.substr(path.find_last_of("/\\") + 1);
+		scene.build = nullptr;
+		scene.replay = &journal;
+		selected.push_back(scene);
+	}
+	if (selected.empty()) {
+		print_usage(args[0]);
+		return -1;
+	}
+
+	if (ranks > 1 && save_directory.size()) {
+		std::cerr << "scenes are saved by a single process" << std::endl;
+		return -1;
+	}
+	if (ranks > 1 && transport_name != "shm" && peers.empty() && rank >= 0) {
+		std::cerr << "ranks started one by one need --peers with the address of every rank" << std::endl;
+		return -1;
+	}
+
+	// Names and addresses of forked ranks are derived from the pid of the first one
+	std::vector<int> children;
+	if (ranks > 1 && rank < 0) {
+#ifdef _WIN32
+		std::cerr << "start every rank with --rank on Windows" << std::endl;
+		return -1;
+#else
+		long session = (long)getpid();
+		if (peers.empty() && transport_name == "unix") {
+			for (int r = 0; r < ranks; r++)
+				peers.push_back("unix:/tmp/tpt-bench-" + std::to_string(session) + "-" + std::to_string(r) + ".sock");
+		}
+		if (peers.empty() && transport_name == "tcp") {
+			for (int r = 0; r < ranks; r++)
+				peers.push_back("127.0.0.1:" + std::to_string(47000 + r));
+		}
+		if (transport_name == "shm")
+			peers = { "/tpt-bench-" + std::to_string(session) };
+		std::cout.flush();
+		std::cerr.flush();
+		rank = 0;
+		for (int r = 1; r < ranks; r++) {
+			pid_t child = fork();
+			if (child < 0) {
+				std::cerr << "could not start rank " << r << std::endl;
+				return -1;
+			}
+			if (!child) {
+				rank = r;
+				children.clear();
+				break;
+			}
+			children.push_back((int)child);
+		}
+#endif
+	}
+	if (rank < 0)
+		rank = 0;
+
+	// Only rank 0 reports
+	std::ostream quiet(nullptr);
+	simulation_log = rank ? &quiet : &std::cerr;
+
+	atom_field * parts = create_atom_field(width, height);
+
+	if (ranks > 1) {
+		halo_transport * transport;
+		if (transport_name == "shm")
+			transport = create_shm_transport(peers.size() ? peers[0] : "/tpt-bench", rank, ranks);
+		else
+			transport = create_socket_transport(peers, rank);
+		if (!transport || !join_world(transport, rank, ranks)) {
+			std::cerr << "rank " << rank << " could not join the world" << std::endl;
+			destroy_atom_field(parts);
+			return -1;
+		}
+	}
+
+	// Writes the initial state of the built in scenes and stops, these can be loaded back with --load
+	if (save_directory.size()) {
+		for (auto & scene : selected) {
+			if (scene.snapshot.size())
+				continue;
+			std::string path = save_directory + "/" + scene.name + ".tpts";
+			clear_atom_field(parts);
+			seed_simulation(seed);
+			scene.build(parts);
+			if (!save_snapshot(parts, path.c_str())) {
+				std::cerr << "Could not write " << path << std::endl;
+				destroy_atom_field(parts);
+				return -1;
+			}
+			std::cerr << "saved " << path << std::endl;
+		}
+		destroy_atom_field(parts);
+		return 0;
+	}
+
+	std::vector<bench_result> results;
+	// Deterministic runs always use the tile scheduler
+	if (deterministic)
+		schedulers = { SCHEDULER_TILES };
+
+	// Every rank traces the whole matrix into a file of its own
+	name_trace_thread(rank > 0 ? "rank " + std::to_string(rank) : "main");
+	if (trace_path.size()) {
+		if (rank > 0)
+			trace_path += "." + std::to_string(rank);
+		if (!start_tracing(trace_counters) && !rank)
+			std::cerr << "hardware counters are not available, tracing without them" << std::endl;
+	}
+
+	for (auto & scene : selected) {
+		// A replay runs once with the scheduler of its session
+		std::vector<scheduler_mode> scene_schedulers = schedulers;
+		std::vector<int> scene_threads = thread_counts, scene_groups = group_counts;
+		if (scene.replay) {
+			scene_schedulers = { (scheduler_mode)scene.replay->header.scheduler };
+			if (!pool_given) {
+				scene_threads = { scene.replay->header.threads };
+				scene_groups = { scene.replay->header.groups };
+			}
+		}
+		for (kernel_isa isa : kernel_isas) {
+			select_kernel(isa);
+			for (scheduler_mode mode : scene_schedulers) {
+				scheduler = mode;
+				for (int groups : scene_groups) {
+					double baseline = 0.0;
+					for (int threads : scene_threads) {
+						if (!rank)
+							std::cerr << "running " << scene.name << " kernel=" << kernel_isa_name(isa) << " threads=" << threads << " groups=" << groups << std::endl;
+						bench_result result;
+						try {
+							result = run_bench(parts, scene, threads, groups, steps, warmup, seed, pool_given);
+						}
+						catch (std::runtime_error & error) {
+							std::cerr << error.what() << std::endl;
+							shutdown_simulation();
+							destroy_atom_field(parts);
+							return -1;
+						}
+						// Scaling is measured against the smallest thread count in the matrix
+						if (baseline == 0.0)
+							baseline = result.steps_per_s / threads;
+						result.efficiency = result.steps_per_s / (baseline * threads);
+						results.push_back(result);
+					}
+					// Tiles ignore the group count
+					if (mode == SCHEDULER_TILES)
+						break;
+				}
+			}
+		}
+	}
+
+	stop_tracing();
+	if (trace_path.size() && !write_trace(trace_path.c_str())) {
+		std::cerr << "Could not write " << trace_path << std::endl;
+		return -1;
+	}
+
+	leave_world();
+	destroy_atom_field(parts);
+
+#ifndef _WIN32
+	bool ranks_failed = false;
+	for (int child : children) {
+		int status;
+		ranks_failed |= waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status);
+	}
+	if (ranks_failed) {
+		std::cerr << "a rank failed" << std::endl;
+		return -1;
+	}
+#endif
+	if (rank)
+		return 0;
+
+	if (output.size()) {
+		std::ofstream file(output);
+		if (!file) {
+			std::cerr << "Could not open " << output << " for writing" << std::endl;
+			return -1;
+		}
+		if (format == "json")
+			write_json(file, results);
+		else
+			write_csv(file, results);
+	}
+	else {
+		if (format == "json")
+			write_json(std::cout, results);
+		else
+			write_csv(std::cout, results);
+	}
+
+	return 0;
+}
@@ -25,6 +25,7 @@
 #include <chrono>
 #include <iostream>
 #include <iomanip>
+#include <cstring>
 
 #define NO_SDL_GLEXT
 #include "SDL.h"
@@ -32,395 +33,11 @@
 #include "GL/glew.h"
 
 #include "tpt-prototype.h"
-
-bool displacementMatrix[6][6]{
-	{false, false, false, false, false, false},
-	{false, false, false, false, false, false},
-	{true, false, false, true, true, false},
-	{true, false, false, false, true, false},
-	{true, false, false, false, true, false},
-	{true, true, true, true, true, true }
-};
-
-struct atom {
-	uint8_t type = TYPE_NONE;
-	float vx = 0.0f;
-	float vy = 0.0f;
-	float x = 0.0f;
-	float y = 0.0f;
-	bool mutex = false;
-};
-
-struct region_bounds {
-	int x;
-	int y;
-	int w;
-	int h;
-};
-
-#define GRAVITYAY 0.5f
-#define VLOSS 0.99f
-#define DIFFUSION 0.2f
-
-#define ISTP 1
-#define COLLISIONLOSS 0.1f
-
-float randfd() {
-	return ((rand() % 1000) / 500.0f) - 1.0f;
-}
-
-int randd() {
-	return (rand() % 2) * 2 - 1;
-}
-
-bool do_move(atom * parts, atom & current, float resultx, float resulty) {
-	int resultx_quant = PART_POS_QUANT(resultx);
-	int resulty_quant = PART_POS_QUANT(resulty);
-	if (resultx_quant < 0 || resultx_quant >= SIMULATIONW || resulty_quant < 0 || resulty_quant >= SIMULATIONH) {
-		current.type = TYPE_NONE;
-		return true;
-	}
-
-	atom & target = parts[PART(resultx_quant, resulty_quant)];
-
-	if (displacementMatrix[current.type][target.type]) {
-		atom temp = target;
-		target = current;
-		current = temp;
-		target.x = resultx;
-		target.y = resulty;
-		return true;
-	}
-	else {
-		return false;
-	}
-}
-
-std::atomic<uint32_t> last_partcount(0);
-
-void simulate_region(atom * parts, region_bounds region, bool mutex) {
-	int nx, ny, neighbourSpace, neighbourDiverse;
-	bool neighbourBlocking;
-
-	float mv = 0.0f, resultx = 0.0f, resulty = 0.0f;
-	int resultx_quant, resulty_quant;
-
-	for (int gridY = region.y; gridY < region.y + region.h; gridY++) {
-		if (gridY == 0 || gridY == SIMULATIONH - 1)
-			continue;
-		for (int gridX = region.x; gridX < region.x + region.w; gridX++) {
-			if (gridX == 0 || gridX == SIMULATIONW - 1)
-				continue;
-
-			atom & current = parts[PART(gridX, gridY)];
-
-			if (current.type == TYPE_NONE)
-				continue;
-
-			last_partcount++;
-
-			if (current.mutex == mutex)
-				continue;
-
-			current.mutex = mutex;
-
-			if (current.type == TYPE_GAS || current.type == TYPE_POWDER || current.type == TYPE_LIQUID) {
-				current.vx *= VLOSS;
-				current.vy *= VLOSS;
-			}
-
-			if (current.type == TYPE_POWDER || current.type == TYPE_LIQUID) {
-				current.vy += GRAVITYAY;
-			}
-
-			if (current.type == TYPE_GAS) {
-				current.vx += DIFFUSION * randfd();
-				current.vy += DIFFUSION * randfd();
-			}
-
-			if (current.type == TYPE_LIQUID) {
-				current.vx += DIFFUSION * randfd() * 0.1f;
-				current.vy += DIFFUSION * randfd() * 0.1f;
-			}
-
-			neighbourSpace = neighbourDiverse = 0;
-			neighbourBlocking = true;
-
-			for (nx = -1; nx < 2; nx++)
-				for (ny = -1; ny < 2; ny++) {
-					if (nx || ny) {
-						atom & neighbour = parts[PART(gridX + nx, gridY + ny)];
-						if (neighbour.type == TYPE_NONE)
-						{
-							neighbourSpace++;
-							neighbourBlocking = false;
-						}
-						if (neighbour.type != current.type)
-							neighbourDiverse++;
-						if (displacementMatrix[neighbour.type][current.type])
-							neighbourBlocking = false;
-					}
-				}
-
-			if (neighbourBlocking) {
-				current.vx = 0.0f;
-				current.vy = 0.0f;
-				continue;
-			}
-
-			if ((fabsf(current.vx) <= 0.01f && fabsf(current.vy) <= 0.01f) || current.type == TYPE_SOLID)
-				continue;
-
-			mv = fmaxf(fabsf(current.vx), fabsf(current.vy));
-
-			//if (mv < ISTP)
-			{
-				resultx = current.x + current.vx;
-				resulty = current.y + current.vy;
-			}
-			//else
-			{
-				//Interpolation, TODO
-			}
-
-			resultx_quant = PART_POS_QUANT(resultx);
-			resulty_quant = PART_POS_QUANT(resulty);
-
-			int clearx = gridX;
-			int cleary = gridY;
-
-			float clearxf = current.x;
-			float clearyf = current.y;
-
-			if (resultx_quant != gridX || resulty_quant != gridY) {
-				if (do_move(parts, current, resultx, resulty))
-					continue;
-				if (current.type == TYPE_GAS) {
-					if (do_move(parts, current, 0.25f + (float)(2 * gridX - resultx_quant), 0.25f + resulty_quant))
-					{
-						current.vx *= COLLISIONLOSS;
-						continue;
-					}
-					else if (do_move(parts, current, 0.25f + resultx_quant, 0.25f + (float)(2 * gridY - resulty_quant)))
-					{
-						current.vy *= COLLISIONLOSS;
-						continue;
-					}
-					else
-					{
-						current.vx *= COLLISIONLOSS;
-						current.vy *= COLLISIONLOSS;
-						continue;
-					}
-				}
-				if (current.type == TYPE_LIQUID || current.type == TYPE_POWDER) {
-					if (resultx_quant != gridX && do_move(parts, current, resultx, gridY))
-					{
-						current.vx *= COLLISIONLOSS;
-						current.vy *= COLLISIONLOSS;
-						continue;
-					}
-					else if (resulty_quant != gridY && do_move(parts, current, gridX, resulty))
-					{
-						current.vx *= COLLISIONLOSS;
-						current.vy *= COLLISIONLOSS;
-						continue;
-					}
-					else {
-						int scanDirection = randd();
-						if (clearx != gridX || cleary != gridY || neighbourDiverse || neighbourSpace)
-						{
-							float dx = current.vx - current.vy * scanDirection;
-							float dy = current.vy + current.vx * scanDirection;
-							if (fabsf(dy) > fabsf(dx))
-								mv = fabsf(dy);
-							else
-								mv = fabsf(dx);
-							dx /= mv;
-							dy /= mv;
-							if (do_move(parts, current, clearxf + dx, clearyf + dy))
-							{
-								current.vx *= COLLISIONLOSS;
-								current.vy *= COLLISIONLOSS;
-								continue;
-							}
-							float swappage = dx;
-							dx = dy * scanDirection;
-							dy = -swappage * scanDirection;
-							if (do_move(parts, current, clearxf + dx, clearyf + dy))
-							{
-								current.vx *= COLLISIONLOSS;
-								current.vy *= COLLISIONLOSS;
-								continue;
-							}
-						}
-						current.vx *= COLLISIONLOSS;
-						current.vy *= COLLISIONLOSS;
-					}
-				}
-			}
-		}
-	}
-}
-
-int threadcount = 0;
-int regioncount = 0;
-int region_group_count = 0;
-region_bounds * regions;
-region_bounds ** region_groups;
-region_bounds * active_regions;
-std::thread * threads;
-std::atomic_flag ** locks;
-
-bool mutex = true;
-
-bool exiting = false;
-
-std::atomic<uint8_t> runs;
-
-void simulate_region_thread(std::atomic_flag * lock, atom * parts, int threadid) {
-	//while (lock->test_and_set(std::memory_order_acquire));
-	while (true) {
-		while (lock->test_and_set(std::memory_order_acquire));
-		if (exiting)
-			break;
-		simulate_region(parts, active_regions[threadid], mutex);
-		runs++;
-	}
-}
-
-void init_simulation(int threadcount_, int groupcount_, atom * parts) {
-	threadcount = threadcount_;
-	region_group_count = std::min(groupcount_, threadcount);
-	regioncount = threadcount_*region_group_count;
-
-	locks = new std::atomic_flag*[threadcount];
-	threads = new std::thread[threadcount];
-	for (int i = 0; i < threadcount; i++) {
-		locks[i] = new std::atomic_flag();
-		locks[i]->test_and_set(std::memory_order_acquire);
-		threads[i] = std::thread(simulate_region_thread, locks[i], parts, i);
-	}
-
-	regions = new region_bounds[regioncount];
-	region_groups = new region_bounds*[region_group_count];
-	for (int i = 0; i < region_group_count; i++)
-		region_groups[i] = new region_bounds[threadcount];
-
-	int regionwidth = SIMULATIONW / regioncount;
-	for (int i = 0; i < regioncount; i++) {
-		regions[i].w = regionwidth;
-		regions[i].h = SIMULATIONH;
-		regions[i].x = regionwidth * i;
-		regions[i].y = 0;
-		
-		if (i == regioncount - 1) {
-			if ((regions[i].w + regions[i].x) != SIMULATIONW) {
-				regions[i].w += SIMULATIONW - (regions[i].w + regions[i].x);
-			}
-		}
-
-
-		region_groups[i % region_group_count][i / region_group_count] = regions[i];
-	}
-
-	std::cout << "configured thread pool: " << threadcount << std::endl;
-	std::cout << "configured region pool: " << regioncount << " in " << region_group_count << " groups." << std::endl;
-}
-
-void reinit_simulation(int threadcount_, int groupcount_, atom * parts) {
-	exiting = true;
-	for (int i = 0; i < threadcount; i++) {
-		locks[i]->clear();
-		threads[i].join();
-	}
-	exiting = false;
-
-	for (int i = 0; i < threadcount; i++) {
-		delete locks[i];
-	}
-	delete[] locks;
-	delete[] threads;
-
-	for (int i = 0; i < region_group_count; i++)
-		delete[] region_groups[i];
-	delete[] region_groups;
-	delete[] regions;
-
-	init_simulation(threadcount_, groupcount_, parts);
-}
-
-void simulate(atom * parts) {
-    /*region_bounds region;
-	region.x = 0;
-	region.y = 0;
-	region.w = SIMULATIONW;
-	region.h = SIMULATIONH;
-	simulate_region(parts, region, mutex);*/
-
-
-	last_partcount = 0;
-
-	for (int j = 0; j < region_group_count; j++) {
-		active_regions = region_groups[j];
-
-		runs = 0;
-
-		for (int i = 0; i < threadcount; i++) {
-			locks[i]->clear();
-		}
-
-		while (runs < threadcount);
-	}
-
-	mutex = !mutex;
-}
-
-void add_parts(atom * parts, int origin_x, int origin_y, uint8_t type) {
-	int radius = 10;
-	for (int y = origin_y - radius; y < origin_y + radius; y++) {
-		if (y < 0 || y >= SIMULATIONH)
-			continue;
-		for (int x = origin_x - radius; x < origin_x + radius; x++) {
-			if (x < 0 || x >= SIMULATIONW)
-				continue;
-			parts[PART(x, y)].type = type;
-			parts[PART(x, y)].vx = 0;
-			parts[PART(x, y)].vy = 0;
-			parts[PART(x, y)].x = x;
-			parts[PART(x, y)].y = y;
-			if (type == TYPE_PARTICLE) {
-				parts[PART(x, y)].vx = randfd() * 5.0f;
-				parts[PART(x, y)].vy = randfd() * 5.0f;
-			}
-		}
-	}
-}
-
-void draw(atom * parts, uint32_t * vid) {
-	std::fill(vid, vid + (WINDOWW * WINDOWH), 0);
-	for (int y = 0; y < SIMULATIONH; y++) {
-		for (int x = 0; x < SIMULATIONW; x++) {
-			switch(parts[PART(x, y)].type) {
-			case TYPE_SOLID:
-				vid[PIX(x, y)] = 0x00FF0000;
-				break;
-			case TYPE_POWDER:
-				vid[PIX(x, y)] = 0x0000FF00;
-				break;
-			case TYPE_LIQUID:
-				vid[PIX(x, y)] = 0x000000FF;
-				break;
-			case TYPE_GAS:
-				vid[PIX(x, y)] = 0x00FFFF00;
-				break;
-			case TYPE_PARTICLE:
-				vid[PIX(x, y)] = 0x00FF00FF;
-				break;
-			}
-		}
-	}
-}
+#include "simulation.h"
+#include "pipeline.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "profiler.h"
 
 std::string get_shader_log(GLuint shader) {
 	std::string log_string;
@@ -524,17 +141,162 @@ GLuint compile_rogram(GLchar * vertex_source, GLchar* fragment_source) {
 	return program;
 }
 
+// The type plane is streamed into an R8UI texture through a ring of
+// persistently mapped pixel buffers, the palette lookup happens in the
+// fragment shader. Only chunks whose types changed are copied and uploaded.
+#define UPLOAD_BUFFERS 3
+
+struct type_texture {
+	GLuint texture;
+	GLuint buffers[UPLOAD_BUFFERS];
+	uint8_t * mapped[UPLOAD_BUFFERS];
+	GLsync fences[UPLOAD_BUFFERS];
+	int current;
+	std::vector<region_bounds> rects;
+};
+
+void create_type_texture(type_texture & target) {
+	glGenTextures(1, &target.texture);
+	glBindTexture(GL_TEXTURE_2D, target.texture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8UI, world_width, world_height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, NULL);
+
+	// Every buffer holds a row-major type plane of the world
+	GLsizeiptr size = (GLsizeiptr)world_width * world_height;
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(UPLOAD_BUFFERS, target.buffers);
+	for (int i = 0; i < UPLOAD_BUFFERS; i++) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, target.buffers[i]);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+		target.mapped[i] = (uint8_t *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+		target.fences[i] = NULL;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, NULL);
+	target.current = 0;
+}
+
+void destroy_type_texture(type_texture & target) {
+	for (int i = 0; i < UPLOAD_BUFFERS; i++) {
+		if (target.fences[i])
+			glDeleteSync(target.fences[i]);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, target.buffers[i]);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, NULL);
+	glDeleteBuffers(UPLOAD_BUFFERS, target.buffers);
+	glDeleteTextures(1, &target.texture);
+}
+
+// Moves on to the next buffer once the GPU is done with it
+uint8_t * next_upload_buffer(type_texture & target) {
+	target.current = (target.current + 1) % UPLOAD_BUFFERS;
+	GLsync & fence = target.fences[target.current];
+	if (fence) {
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(fence);
+		fence = NULL;
+	}
+	return target.mapped[target.current];
+}
+
+// Copies target.rects of a snapshot into the next buffer, returns the number
+// of bytes staged
+size_t stage_type_texture(type_texture & target, const uint8_t * types) {
+	size_t staged = 0;
+	uint8_t * mapped = next_upload_buffer(target);
+	for (auto & rect : target.rects) {
+		for (int y = rect.y; y < rect.y + rect.h; y++)
+			memcpy(mapped + PART(rect.x, y), types + PART(rect.x, y), rect.w);
+		staged += rect.w * rect.h;
+	}
+	return staged;
+}
+
+// Same straight from the pages of the field
+size_t stage_type_texture(type_texture & target, atom_field * parts) {
+	size_t staged = 0;
+	uint8_t * mapped = next_upload_buffer(target);
+	for (auto & rect : target.rects) {
+		copy_types(parts, rect, mapped);
+		staged += rect.w * rect.h;
+	}
+	return staged;
+}
+
+void upload_type_texture(type_texture & target) {
+	if (target.rects.empty())
+		return;
+
+	glBindTexture(GL_TEXTURE_2D, target.texture);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, target.buffers[target.current]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, world_width);
+	for (auto & rect : target.rects)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.w, rect.h, GL_RED_INTEGER, GL_UNSIGNED_BYTE, (void *)(uintptr_t)(PART(rect.x, rect.y)));
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, NULL);
+	target.fences[target.current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
 int main(int argc, char * args[])
 {
 	int num_threads = 4;
 	int num_groups = 2;
-
-	if (argc > 1) {
+	uint64_t seed = 0;
+	bool pipelined = false;
+	int width = SIMULATIONW, height = SIMULATIONH;
+	bool sized = false;
+	// F5 saves to and F9 loads from this file
+	std::string snapshot_path = "world.tpts";
+	bool load = false;
+	std::string journal_path;
+	// Chrome trace of the whole session, written on exit
+	std::string trace_path;
+	bool trace_counters = false;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = args[i];
 		try {
-			std::stoi(args[1]);
+			if (arg == "--deterministic")
+				deterministic = true;
+			else if (arg == "--no-air")
+				air_enabled = false;
+			else if (arg == "--blocks")
+				atom_engine = ENGINE_BLOCKS;
+			else if (arg == "--pipelined")
+				pipelined = true;
+			else if (arg == "--counters")
+				trace_counters = true;
+			else if (arg == "--no-huge-pages")
+				huge_pages = false;
+			else if (arg == "--pin" && i + 1 < argc)
+				thread_pinning = parse_pinning(args[++i], pinned_cores);
+			else if (arg == "--trace" && i + 1 < argc)
+				trace_path = args[++i];
+			else if (arg == "--seed" && i + 1 < argc)
+				seed = std::stoull(args[++i]);
+			else if (arg == "--size" && i + 1 < argc) {
+				std::string size = args[++i];
+				size_t separator = size.find('x');
+				width = std::stoi(size.substr(0, separator));
+				height = separator == std::string::npos ? width : std::stoi(size.substr(separator + 1));
+				if (width < 3 || height < 3)
+					throw std::exception("world too small");
+				sized = true;
+			}
+			else if (arg == "--record" && i + 1 < argc)
+				journal_path = args[++i];
+			else if (arg == "--load" && i + 1 < argc) {
+				snapshot_path = args[++i];
+				load = true;
+			}
+			else
+				num_threads = std::stoi(arg);
 		}
 		catch (std::exception) {
-			std::cout << "Invalid thread count supplied on command line, usage: " << args[0] << " <threadcount>" << std::endl;
+			std::cout << "Invalid command line, usage: " << args[0] << " [--deterministic] [--no-air] [--blocks] [--pipelined] [--pin none|compact|scatter|cores] [--no-huge-pages] [--trace file] [--counters] [--seed N] [--size WxH] [--load file] [--record journal] <threadcount>" << std::endl;
 			return -1;
 		}
 	}
@@ -544,6 +306,12 @@ int main(int argc, char * args[])
 		return -1;
 	}
 
+	// The world takes the size of the snapshot unless one is given
+	if (load && !sized && !snapshot_size(snapshot_path.c_str(), width, height)) {
+		std::cout << snapshot_path << " is not a snapshot" << std::endl;
+		return -1;
+	}
+
 	SDL_Init(SDL_INIT_VIDEO);
 
 	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
@@ -564,11 +332,20 @@ int main(int argc, char * args[])
 	glewInit();
 
 	char * vertex = "#version 440\nin vec2 vertexPos2D; out vec2 texCoord; void main() { gl_Position = vec4(vertexPos2D.x, vertexPos2D.y, 0, 1); texCoord = (vertexPos2D * vec2(0.5, -0.5)) + vec2(0.5, 0.5); }";
-	char * fragment = "#version 440\nuniform sampler2D texture; in vec2 texCoord; out vec4 fragColour; void main() { fragColour = texture2D(texture, texCoord.st); }";
+	char * fragment = "#version 440\nuniform usampler2D types; uniform vec4 palette[8]; in vec2 texCoord; out vec4 fragColour; void main() { ivec2 size = textureSize(types, 0); uint type = texelFetch(types, min(ivec2(texCoord * vec2(size)), size - 1), 0).r; fragColour = palette[min(type, 7u)]; }";
 
 	GLuint program = compile_rogram(vertex, fragment);
 	GLuint attrib_vertex_pos = glGetAttribLocation(program, "vertexPos2D");
-	GLuint uniform_texture_sampler = glGetAttribLocation(program, "texture");
+	GLint uniform_texture_sampler = glGetUniformLocation(program, "types");
+	GLint uniform_palette = glGetUniformLocation(program, "palette");
+
+	GLfloat palette[8 * 4] = {};
+	for (int type = 0; type < TYPE_COUNT; type++) {
+		palette[type * 4 + 0] = (type_colours[type] & 0xFF) / 255.0f;
+		palette[type * 4 + 1] = ((type_colours[type] >> 8) & 0xFF) / 255.0f;
+		palette[type * 4 + 2] = ((type_colours[type] >> 16) & 0xFF) / 255.0f;
+		palette[type * 4 + 3] = 1.0f;
+	}
 
 	GLuint vertex_array_object;
 	glGenVertexArrays(1, &vertex_array_object);
@@ -594,26 +371,61 @@ int main(int argc, char * args[])
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_buffer_object);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, 4 * sizeof(GLuint), index_data, GL_STATIC_DRAW);
 
-	GLuint texture;
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SIMULATIONW, SIMULATIONH, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, NULL);
-
-	glClearColor(0, 0, 0, 1);	
+	atom_field * parts = create_atom_field(width, height);
 
-	uint32_t * vid = new uint32_t[WINDOWW * WINDOWH];
-	atom * parts = new atom[SIMULATIONW * SIMULATIONH];
+	type_texture texture;
+	create_type_texture(texture);
 
-	std::fill(parts, parts + (SIMULATIONW * SIMULATIONH), atom());
+	glClearColor(0, 0, 0, 1);	
 	
 	uint8_t particle_type = TYPE_POWDER;
 
-	init_simulation(num_threads, num_groups, parts);
+	seed_simulation(seed);
+	init_simulation(num_threads, num_groups);
 
-	float average_sim_time = 0.0f, average_draw_time = 0.0f, average_gl_draw_time = 0.0f;
+	if (load && !load_snapshot(parts, snapshot_path.c_str()))
+		return -1;
+
+	// Edits are recorded where they are applied, on the simulation thread when pipelined
+	session_journal journal;
+	session_journal * recording = nullptr;
+	if (journal_path.size()) {
+		journal.begin(num_threads, num_groups, load ? snapshot_path : std::string());
+		recording = &journal;
+		edit_applied = [&journal](const atom_edit & edit) {
+			journal.record_edit(edit);
+		};
+	}
+
+	// With the pipeline running the simulation thread owns the field, anything
+	// touching it or the scheduler settings is queued instead
+	sim_pipeline pipeline;
+	auto edit = [&](std::function<void(atom_field *)> command) {
+		if (pipeline.started())
+			pipeline.queue(std::move(command));
+		else
+			command(parts);
+	};
+	// Edits never wait for the simulation
+	auto paint = [&](const atom_edit & edit) {
+		queue_edit(edit);
+		if (pipeline.started())
+			pipeline.wake();
+	};
+	auto resize_pool = [&]() {
+		int threads = num_threads, groups = num_groups;
+		edit([=](atom_field *) {
+			reinit_simulation(threads, groups);
+			if (recording)
+				recording->record(JOURNAL_POOL, threads, groups, 0);
+		});
+	};
+
+	float average_sim_time = 0.0f, average_draw_time = 0.0f, average_gl_draw_time = 0.0f, average_upload = 0.0f, average_frame_time = 0.0f;
+	uint32_t partcount = 0;
+	uint64_t moves = 0;
+	uint64_t steps = 0, last_step = 0;
+	auto report_start = std::chrono::high_resolution_clock::now();
 
 	bool running = true;
 	bool mouse_down = false;
@@ -623,8 +435,18 @@ int main(int argc, char * args[])
 	bool simulating = true;
 	bool step_lock = false;
 
+	name_trace_thread("main");
+	if (trace_path.size() && !start_tracing(trace_counters))
+		std::cout << "hardware counters are not available, tracing without them" << std::endl;
+
+	if (pipelined)
+		pipeline.start(parts, false);
+
 	while (running) {
 		frame_counter++;
+		auto frame_start = std::chrono::high_resolution_clock::now();
+		trace_scope frame_scope("frame", frame_counter);
+		auto events_start = std::chrono::steady_clock::now();
 		SDL_Event event;
 		while (SDL_PollEvent(&event))
 		{
@@ -637,10 +459,27 @@ int main(int argc, char * args[])
 				switch (event.key.keysym.sym) {
 				case SDLK_SPACE:
 					simulating = !simulating;
+					if (pipeline.started())
+						pipeline.pause(!simulating);
 					break;
 				case SDLK_f:
-					simulating = true;
-					step_lock = true;
+					if (pipeline.started()) {
+						simulating = false;
+						pipeline.step();
+					}
+					else {
+						simulating = true;
+						step_lock = true;
+					}
+					break;
+				case SDLK_p:
+					if (pipeline.started()) {
+						pipeline.stop();
+					}
+					else {
+						last_step = simulation_step;
+						pipeline.start(parts, !simulating);
+					}
 					break;
 				case SDLK_0:
 					particle_type = TYPE_NONE;
@@ -660,6 +499,58 @@ int main(int argc, char * args[])
 				case SDLK_5:
 					particle_type = TYPE_PARTICLE;
 					break;
+				case SDLK_F5:
+					edit([=](atom_field * parts) {
+						if (save_snapshot(parts, snapshot_path.c_str()))
+							std::cout << "saved " << snapshot_path << std::endl;
+						else
+							std::cout << "could not write " << snapshot_path << std::endl;
+					});
+					break;
+				case SDLK_F9:
+					// A replay could not follow a world replaced halfway through
+					if (recording) {
+						std::cout << "loading is disabled while recording" << std::endl;
+						break;
+					}
+					edit([=](atom_field * parts) {
+						if (load_snapshot(parts, snapshot_path.c_str()))
+							std::cout << "loaded " << snapshot_path << std::endl;
+					});
+					break;
+				case SDLK_DELETE:
+					paint(fill_edit(region_bounds{ 0, 0, world_width, world_height }, TYPE_NONE));
+					break;
+				case SDLK_r:
+					// Turns every atom of the type under the cursor into the selected type
+					{
+						int x, y;
+						SDL_GetMouseState(&x, &y);
+						x = x * world_width / WINDOWW;
+						y = y * world_height / WINDOWH;
+						uint8_t type = particle_type;
+						edit([=](atom_field * parts) {
+							if (x >= 0 && x < world_width && y >= 0 && y < world_height)
+								queue_edit(retype_edit(region_bounds{ 0, 0, world_width, world_height }, type_at(parts, x, y), type));
+						});
+					}
+					break;
+				case SDLK_t:
+					edit([=](atom_field *) {
+						scheduler = scheduler == SCHEDULER_TILES ? SCHEDULER_STRIPS : SCHEDULER_TILES;
+						reinit_simulation(num_threads, num_groups);
+						if (recording)
+							recording->record(JOURNAL_SCHEDULER, 0, 0, (uint8_t)scheduler);
+					});
+					break;
+				case SDLK_b:
+					// Switches powder and liquid between the atom and the block engine
+					edit([=](atom_field *) {
+						atom_engine = atom_engine == ENGINE_BLOCKS ? ENGINE_ATOMS : ENGINE_BLOCKS;
+						if (recording)
+							recording->record(JOURNAL_ENGINE, 0, 0, (uint8_t)atom_engine);
+					});
+					break;
 				case SDLK_PAGEUP:
 					if ((event.key.keysym.mod & KMOD_LSHIFT) == KMOD_LSHIFT)
 					{
@@ -668,20 +559,20 @@ int main(int argc, char * args[])
 					else {
 						num_threads++;
 					}
-					reinit_simulation(num_threads, num_groups, parts);
+					resize_pool();
 					break;
 				case SDLK_PAGEDOWN:
 					if ((event.key.keysym.mod & KMOD_LSHIFT) == KMOD_LSHIFT)
 					{
 						if (num_groups > 2) {
 							num_groups--;
-							reinit_simulation(num_threads, num_groups, parts);
+							resize_pool();
 						}
 					}
 					else {
 						if (num_threads > 1) {
 							num_threads--;
-							reinit_simulation(num_threads, num_groups, parts);
+							resize_pool();
 						}
 					}
 					break;
@@ -689,8 +580,11 @@ int main(int argc, char * args[])
 				break;
 			}
 			case SDL_MOUSEMOTION:
-				if(mouse_down)
-					add_parts(parts, event.motion.x, event.motion.y, particle_type);
+				if (mouse_down) {
+					// The whole world is stretched over the window
+					int x = event.motion.x * world_width / WINDOWW, y = event.motion.y * world_height / WINDOWH;
+					paint(brush_edit(x, y, particle_type));
+				}
 				break;
 			case SDL_MOUSEBUTTONUP:
 				mouse_down = false;
@@ -701,60 +595,133 @@ int main(int argc, char * args[])
 			}
 		}
 
+		trace_complete("events", events_start, std::chrono::steady_clock::now());
+
 		auto simulated = false;
 		auto simulation_start = std::chrono::high_resolution_clock::now();
-		if (simulating) {
+		if (simulating && !pipeline.started()) {
 			simulated = true;
-			simulate(parts);
+			steps++;
+			const step_stats & stats = simulate(parts);
+			partcount = stats.partcount;
+			moves = stats.moves;
 			if (step_lock) {
 				step_lock = false;
 				simulating = false;
 			}
 		}
+		else if (!pipeline.started()) {
+			apply_edits(parts);
+		}
 
 		glClear(GL_COLOR_BUFFER_BIT);
 
 		auto draw_start = std::chrono::high_resolution_clock::now();
-		draw(parts, vid);
+		size_t upload = 0;
+		if (pipeline.started()) {
+			// Draws the latest finished step while the next one is simulated
+			const frame_snapshot * snapshot = pipeline.acquire();
+			if (snapshot) {
+				trace_scope scope("stage");
+				texture.rects = snapshot->rects;
+				upload = stage_type_texture(texture, snapshot->type);
+				partcount = snapshot->stats.partcount;
+				moves = snapshot->stats.moves;
+				if (snapshot->step != last_step) {
+					steps += snapshot->step - last_step;
+					last_step = snapshot->step;
+					average_sim_time = (average_sim_time * 0.9f) + ((float)snapshot->stats.step_ms * 0.1f);
+				}
+				pipeline.release();
+			}
+			else {
+				texture.rects.clear();
+			}
+		}
+		else {
+			trace_scope scope("stage");
+			collect_dirty_rects(parts, texture.rects);
+			upload = stage_type_texture(texture, parts);
+		}
 
 		auto gl_draw_start = std::chrono::high_resolution_clock::now();
 
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SIMULATIONW, SIMULATIONH, 0, GL_RGBA, GL_UNSIGNED_BYTE, vid);
-		
-		glBindTexture(GL_TEXTURE_2D, texture);
+		{
+			trace_scope scope("upload");
+			upload_type_texture(texture);
+		}
+
+		{
+			trace_scope scope("gl draw");
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, texture.texture);
 
-		glUseProgram(program);
-		glUniform1i(uniform_texture_sampler, 0);
-		glEnableVertexAttribArray(attrib_vertex_pos);
+			glUseProgram(program);
+			glUniform1i(uniform_texture_sampler, 0);
+			glUniform4fv(uniform_palette, 8, palette);
+			glEnableVertexAttribArray(attrib_vertex_pos);
 
-		glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_object);
-		glVertexAttribPointer(attrib_vertex_pos, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), NULL);
+			glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_object);
+			glVertexAttribPointer(attrib_vertex_pos, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), NULL);
 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_buffer_object);
-		glDrawElements(GL_TRIANGLE_FAN, 4, GL_UNSIGNED_INT, NULL);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_buffer_object);
+			glDrawElements(GL_TRIANGLE_FAN, 4, GL_UNSIGNED_INT, NULL);
 
-		glDisableVertexAttribArray(attrib_vertex_pos);
-		glUseProgram(NULL);
+			glDisableVertexAttribArray(attrib_vertex_pos);
+			glUseProgram(NULL);
+		}
 		
 		auto gl_draw_end = std::chrono::high_resolution_clock::now();
 
-		SDL_GL_SwapWindow(window);
+		{
+			trace_scope scope("swap");
+			SDL_GL_SwapWindow(window);
+		}
+
+		auto frame_end = std::chrono::high_resolution_clock::now();
 
 		auto sim_time = std::chrono::duration_cast<std::chrono::microseconds>(draw_start - simulation_start);
 		auto draw_time = std::chrono::duration_cast<std::chrono::microseconds>(gl_draw_start - draw_start);
 		auto gl_draw_time = std::chrono::duration_cast<std::chrono::microseconds>(gl_draw_end - gl_draw_start);
+		auto frame_time = std::chrono::duration_cast<std::chrono::microseconds>(frame_end - frame_start);
 
 		if (simulated) {
 			average_sim_time = (average_sim_time * 0.9f) + ((sim_time.count() / 1000.0f) * 0.1f);
 		}
 		average_draw_time = (average_draw_time * 0.9f) + ((draw_time.count() / 1000.0f) * 0.1f);
 		average_gl_draw_time = (average_gl_draw_time * 0.9f) + ((gl_draw_time.count()/1000.0f) * 0.1f);
+		average_upload = (average_upload * 0.9f) + ((upload / 1024.0f) * 0.1f);
+		average_frame_time = (average_frame_time * 0.9f) + ((frame_time.count() / 1000.0f) * 0.1f);
 
 		if (!(frame_counter % 100)) {
-			std::cout << "parts[" << last_partcount << "] sim[" << average_sim_time << "ms] draw[" << average_draw_time << "ms, " << average_gl_draw_time << "ms]" << std::endl;
+			float report_seconds = std::chrono::duration_cast<std::chrono::microseconds>(frame_end - report_start).count() / 1000000.0f;
+			std::cout << "parts[" << partcount << "] moves[" << moves << "] sim[" << average_sim_time << "ms] draw[" << average_draw_time << "ms, " << average_gl_draw_time << "ms] upload[" << average_upload << "KiB] frame[" << average_frame_time << "ms] steps[" << steps / report_seconds << "/s]" << (pipeline.started() ? " pipelined" : "") << std::endl;
+			steps = 0;
+			report_start = frame_end;
 		}
 	}
 
+	pipeline.stop();
+
+	stop_tracing();
+	if (trace_path.size()) {
+		if (write_trace(trace_path.c_str()))
+			std::cout << "wrote trace to " << trace_path << std::endl;
+		else
+			std::cout << "could not write " << trace_path << std::endl;
+	}
+
+	if (recording) {
+		if (journal.save(parts, journal_path.c_str()))
+			std::cout << "recorded " << journal.length() << " steps to " << journal_path << std::endl;
+		else
+			std::cout << "could not write " << journal_path << std::endl;
+	}
+
+	destroy_type_texture(texture);
+	shutdown_simulation();
+	destroy_atom_field(parts);
+
 	SDL_GL_DeleteContext(gl_context);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
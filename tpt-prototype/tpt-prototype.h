@@ -3,6 +3,7 @@
 
 #pragma once
 
+// Default world size, the world is sized at runtime by create_atom_field
 #define SIMULATIONW 800
 #define SIMULATIONH 600
 
@@ -15,8 +16,21 @@
 #define TYPE_LIQUID 3
 #define TYPE_GAS 4
 #define TYPE_PARTICLE 5
+#define TYPE_COUNT 6
 
-#define PART(x, y) (x) + ((y) * SIMULATIONW)
+// Row-major index into planes covering the whole world, like the render snapshots
+#define PART(x, y) (x) + ((y) * world_width)
+
+// Bitplanes pack one bit per cell, each row padded to whole 64 bit words
+#define BIT(x, y) (((x) >> 6) + ((y) * bitplane_stride))
+
+// The grid is also split into CHUNK_SIZE square chunks which sleep when settled
+// and hold their atoms in a page of their own
+#define CHUNK_SIZE 32
+#define CHUNK_CELLS (CHUNK_SIZE * CHUNK_SIZE)
+#define CHUNK(x, y) (((x) / CHUNK_SIZE) + (((y) / CHUNK_SIZE) * chunk_columns))
+// Index of a cell inside the page of its chunk
+#define CELL(x, y) (((x) & (CHUNK_SIZE - 1)) + (((y) & (CHUNK_SIZE - 1)) * CHUNK_SIZE))
 
 #define PART_POS_QUANT(x) ((int)(x + 0.5f))
 
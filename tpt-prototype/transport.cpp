@@ -0,0 +1,419 @@
+﻿/**
+	This file is part of The Powder Toy.
+
+	The Powder Toy is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	The Powder Toy is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with The Powder Toy.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "transport.h"
+#include "simulation.h"
+#include "thread_pool.h"
+
+#ifndef _WIN32
+
+// Bytes buffered in each direction between two neighbouring ranks, larger
+// messages are streamed through
+#define SHM_RING_BYTES (4 << 20)
+// How long a rank keeps trying to reach the rank below it
+#define CONNECT_TIMEOUT_MS 30000
+// Ranks on shared memory show they are alive by bumping a heartbeat this
+// often, a neighbour that stops for the timeout is given up on
+#define HEARTBEAT_MS 10
+#define HEARTBEAT_TIMEOUT_MS 5000
+// Halo messages stay far below this, a longer length means a garbage stream
+#define MESSAGE_MAX_BYTES ((uint64_t)1 << 32)
+
+// Single producer, single consumer byte ring
+struct shm_ring {
+	alignas(64) std::atomic<uint64_t> head;	// bytes written
+	alignas(64) std::atomic<uint64_t> tail;	// bytes read
+	alignas(64) uint8_t data[SHM_RING_BYTES];
+};
+
+// Followed by a peer per rank and two rings per border, the one going down first
+struct shm_header {
+	alignas(64) std::atomic<int32_t> ranks;
+	std::atomic<int32_t> attached;
+};
+
+// Lets the neighbours of a rank notice when it is gone
+struct alignas(64) shm_peer {
+	std::atomic<uint64_t> heartbeat;	// 0 until the rank attached
+	std::atomic<int32_t> left;	// set when the rank let go of the segment
+};
+
+// Atomics in shared memory only work between processes when they are lock free
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "rings are shared between processes");
+
+class shm_transport : public halo_transport {
+	void * mapping;
+	size_t size;
+	int rank;
+	shm_peer * peers;
+	shm_ring * rings;
+	spin_waiter waiter;
+	std::atomic<bool> stopping;
+	std::thread heartbeat;
+
+	shm_ring & ring(int from, int to) {
+		return rings[std::min(from, to) * 2 + (from > to)];
+	}
+
+	// Neighbours usually answer within a phase, after that waiting gets cheap.
+	// False when the peer went away without making ready true, a rank that
+	// crashed never sets left but its heartbeat stops.
+	template<typename Predicate>
+	bool wait(int peer, Predicate ready) {
+		uint64_t beat = peers[peer].heartbeat.load(std::memory_order_relaxed);
+		auto beat_time = std::chrono::steady_clock::now();
+		while (!waiter.spin(ready)) {
+			if (peers[peer].left.load(std::memory_order_acquire))
+				return ready();
+			auto now = std::chrono::steady_clock::now();
+			uint64_t current = peers[peer].heartbeat.load(std::memory_order_relaxed);
+			if (current != beat) {
+				beat = current;
+				beat_time = now;
+			}
+			// A rank that has not attached yet may still be starting up
+			else if (now - beat_time > std::chrono::milliseconds(beat ? HEARTBEAT_TIMEOUT_MS : CONNECT_TIMEOUT_MS))
+				return ready();
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+		return true;
+	}
+
+	bool write(int peer, const uint8_t * data, size_t count) {
+		shm_ring & ring = this->ring(rank, peer);
+		uint64_t head = ring.head.load(std::memory_order_relaxed);
+		while (count) {
+			if (!wait(peer, [&] { return head - ring.tail.load(std::memory_order_acquire) < SHM_RING_BYTES; }))
+				return false;
+			size_t space = SHM_RING_BYTES - (size_t)(head - ring.tail.load(std::memory_order_acquire));
+			size_t offset = (size_t)(head % SHM_RING_BYTES);
+			size_t length = std::min(std::min(count, space), SHM_RING_BYTES - offset);
+			memcpy(ring.data + offset, data, length);
+			head += length;
+			data += length;
+			count -= length;
+			ring.head.store(head, std::memory_order_release);
+		}
+		return true;
+	}
+
+	bool read(int peer, uint8_t * data, size_t count) {
+		shm_ring & ring = this->ring(peer, rank);
+		uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+		while (count) {
+			if (!wait(peer, [&] { return ring.head.load(std::memory_order_acquire) != tail; }))
+				return false;
+			size_t available = (size_t)(ring.head.load(std::memory_order_acquire) - tail);
+			size_t offset = (size_t)(tail % SHM_RING_BYTES);
+			size_t length = std::min(std::min(count, available), SHM_RING_BYTES - offset);
+			memcpy(data, ring.data + offset, length);
+			tail += length;
+			data += length;
+			count -= length;
+			ring.tail.store(tail, std::memory_order_release);
+		}
+		return true;
+	}
+
+public:
+	shm_transport(void * mapping_, size_t size_, int rank_, int ranks) : mapping(mapping_), size(size_), rank(rank_), stopping(false) {
+		peers = (shm_peer *)((uint8_t *)mapping + sizeof(shm_header));
+		rings = (shm_ring *)(peers + ranks);
+		peers[rank].heartbeat.store(1, std::memory_order_relaxed);
+		heartbeat = std::thread([this] {
+			while (!stopping.load(std::memory_order_relaxed)) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(HEARTBEAT_MS));
+				peers[rank].heartbeat.fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+	}
+
+	~shm_transport() {
+		stopping.store(true, std::memory_order_relaxed);
+		heartbeat.join();
+		peers[rank].left.store(1, std::memory_order_release);
+		munmap(mapping, size);
+	}
+
+	bool send(int peer, const void * data, size_t count) override {
+		uint64_t length = count;
+		return write(peer, (const uint8_t *)&length, sizeof(length)) && write(peer, (const uint8_t *)data, count);
+	}
+
+	bool receive(int peer, std::vector<uint8_t> & data) override {
+		uint64_t length;
+		if (!read(peer, (uint8_t *)&length, sizeof(length)) || length > MESSAGE_MAX_BYTES)
+			return false;
+		data.resize((size_t)length);
+		return read(peer, data.data(), data.size());
+	}
+};
+
+halo_transport * create_shm_transport(const std::string & name, int rank, int ranks) {
+	size_t size = sizeof(shm_header) + sizeof(shm_peer) * ranks + sizeof(shm_ring) * 2 * std::max(ranks - 1, 0);
+	int descriptor = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+	if (descriptor < 0) {
+		*simulation_log << "could not open shared memory " << name << ": " << strerror(errno) << std::endl;
+		return nullptr;
+	}
+	// Growing a fresh segment zeroes it, which is the empty state of every ring
+	struct stat status;
+	if (fstat(descriptor, &status) || ((size_t)status.st_size < size && ftruncate(descriptor, (off_t)size))) {
+		*simulation_log << "could not size shared memory " << name << ": " << strerror(errno) << std::endl;
+		close(descriptor);
+		return nullptr;
+	}
+	void * mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+	if (mapping == MAP_FAILED) {
+		*simulation_log << "could not map shared memory " << name << ": " << strerror(errno) << std::endl;
+		return nullptr;
+	}
+
+	shm_header * header = (shm_header *)mapping;
+	int32_t expected = 0;
+	if (!header->ranks.compare_exchange_strong(expected, ranks) && expected != ranks) {
+		*simulation_log << "shared memory " << name << " belongs to a run of " << expected << " ranks" << std::endl;
+		munmap(mapping, size);
+		return nullptr;
+	}
+	int attached = header->attached.fetch_add(1) + 1;
+	if (attached > ranks) {
+		*simulation_log << "shared memory " << name << " is left over from another run, remove it first" << std::endl;
+		munmap(mapping, size);
+		return nullptr;
+	}
+	if (attached == ranks)
+		shm_unlink(name.c_str());
+	return new shm_transport(mapping, size, rank, ranks);
+}
+
+// Socket address of host:port or unix:path
+struct socket_address {
+	sockaddr_storage storage;
+	socklen_t length;
+	int family;
+	std::string path;	// unix sockets only
+};
+
+bool resolve_address(const std::string & address, socket_address & result) {
+	memset(&result.storage, 0, sizeof(result.storage));
+	if (address.compare(0, 5, "unix:") == 0) {
+		sockaddr_un & local = (sockaddr_un &)result.storage;
+		result.path = address.substr(5);
+		if (result.path.empty() || result.path.size() >= sizeof(local.sun_path))
+			return false;
+		local.sun_family = AF_UNIX;
+		memcpy(local.sun_path, result.path.c_str(), result.path.size() + 1);
+		result.length = sizeof(sockaddr_un);
+		result.family = AF_UNIX;
+		return true;
+	}
+
+	size_t separator = address.rfind(':');
+	if (separator == std::string::npos)
+		return false;
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo * found = nullptr;
+	if (getaddrinfo(address.substr(0, separator).c_str(), address.substr(separator + 1).c_str(), &hints, &found) || !found)
+		return false;
+	memcpy(&result.storage, found->ai_addr, found->ai_addrlen);
+	result.length = (socklen_t)found->ai_addrlen;
+	result.family = found->ai_family;
+	freeaddrinfo(found);
+	return true;
+}
+
+bool send_bytes(int descriptor, const uint8_t * data, size_t count) {
+	while (count) {
+#ifdef MSG_NOSIGNAL
+		ssize_t sent = ::send(descriptor, data, count, MSG_NOSIGNAL);
+#else
+		ssize_t sent = ::send(descriptor, data, count, 0);
+#endif
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return false;
+		data += sent;
+		count -= (size_t)sent;
+	}
+	return true;
+}
+
+bool receive_bytes(int descriptor, uint8_t * data, size_t count) {
+	while (count) {
+		ssize_t received = ::recv(descriptor, data, count, 0);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received <= 0)
+			return false;
+		data += received;
+		count -= (size_t)received;
+	}
+	return true;
+}
+
+// Halo rows are sent in one go right before the neighbour waits for them
+void set_no_delay(int descriptor, const socket_address & address) {
+	if (address.family != AF_UNIX) {
+		int enable = 1;
+		setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	}
+}
+
+class socket_transport : public halo_transport {
+	int rank;
+	int below;	// connection to rank - 1
+	int above;	// connection to rank + 1
+
+	int descriptor(int peer) const {
+		return peer < rank ? below : above;
+	}
+
+public:
+	socket_transport(int rank_, int below_, int above_) : rank(rank_), below(below_), above(above_) {
+	}
+
+	~socket_transport() {
+		if (below >= 0)
+			close(below);
+		if (above >= 0)
+			close(above);
+	}
+
+	bool send(int peer, const void * data, size_t count) override {
+		uint64_t length = count;
+		return send_bytes(descriptor(peer), (const uint8_t *)&length, sizeof(length)) && send_bytes(descriptor(peer), (const uint8_t *)data, count);
+	}
+
+	bool receive(int peer, std::vector<uint8_t> & data) override {
+		uint64_t length;
+		if (!receive_bytes(descriptor(peer), (uint8_t *)&length, sizeof(length)) || length > MESSAGE_MAX_BYTES)
+			return false;
+		data.resize((size_t)length);
+		return receive_bytes(descriptor(peer), data.data(), data.size());
+	}
+};
+
+halo_transport * create_socket_transport(const std::vector<std::string> & addresses, int rank) {
+	int ranks = (int)addresses.size();
+	socket_address own, lower;
+	if (!resolve_address(addresses[rank], own) || (rank > 0 && !resolve_address(addresses[rank - 1], lower))) {
+		*simulation_log << "could not resolve the addresses of rank " << rank << " and the rank below it" << std::endl;
+		return nullptr;
+	}
+
+	// Listen before connecting, so the rank above can connect while this one waits for the rank below
+	int listener = -1;
+	if (rank + 1 < ranks) {
+		listener = socket(own.family, SOCK_STREAM, 0);
+		int reuse = 1;
+		if (listener >= 0)
+			setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (own.family == AF_UNIX)
+			unlink(own.path.c_str());
+		if (listener < 0 || bind(listener, (sockaddr *)&own.storage, own.length) || listen(listener, 1)) {
+			*simulation_log << "could not listen on " << addresses[rank] << ": " << strerror(errno) << std::endl;
+			if (listener >= 0)
+				close(listener);
+			return nullptr;
+		}
+	}
+
+	int below = -1, above = -1;
+	if (rank > 0) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(CONNECT_TIMEOUT_MS);
+		while (true) {
+			below = socket(lower.family, SOCK_STREAM, 0);
+			if (below >= 0 && connect(below, (sockaddr *)&lower.storage, lower.length) == 0)
+				break;
+			if (below >= 0)
+				close(below);
+			below = -1;
+			if (std::chrono::steady_clock::now() > deadline)
+				break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+		int32_t hello = rank;
+		if (below < 0 || !send_bytes(below, (const uint8_t *)&hello, sizeof(hello))) {
+			*simulation_log << "could not connect to rank " << rank - 1 << " at " << addresses[rank - 1] << std::endl;
+			if (below >= 0)
+				close(below);
+			if (listener >= 0)
+				close(listener);
+			return nullptr;
+		}
+		set_no_delay(below, lower);
+	}
+
+	if (listener >= 0) {
+		do
+			above = accept(listener, nullptr, nullptr);
+		while (above < 0 && errno == EINTR);
+		close(listener);
+		if (own.family == AF_UNIX)
+			unlink(own.path.c_str());
+		int32_t hello = -1;
+		if (above < 0 || !receive_bytes(above, (uint8_t *)&hello, sizeof(hello)) || hello != rank + 1) {
+			*simulation_log << "rank " << rank + 1 << " did not connect to " << addresses[rank] << std::endl;
+			if (above >= 0)
+				close(above);
+			if (below >= 0)
+				close(below);
+			return nullptr;
+		}
+		set_no_delay(above, own);
+	}
+
+	return new socket_transport(rank, below, above);
+}
+
+#else
+
+halo_transport * create_shm_transport(const std::string & name, int rank, int ranks) {
+	*simulation_log << "split worlds are not supported on Windows yet" << std::endl;
+	return nullptr;
+}
+
+halo_transport * create_socket_transport(const std::vector<std::string> & addresses, int rank) {
+	*simulation_log << "split worlds are not supported on Windows yet" << std::endl;
+	return nullptr;
+}
+
+#endif
@@ -0,0 +1,29 @@
+﻿// transport.h : Message streams between the processes of a world split into
+// bands (distributed.h). A rank only talks to the ranks holding the bands
+// directly above and below its own.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class halo_transport {
+public:
+	virtual ~halo_transport() {}
+	// Both block until the whole message is through. Messages between two ranks
+	// arrive in the order they were sent, false when the peer went away.
+	virtual bool send(int peer, const void * data, size_t size) = 0;
+	virtual bool receive(int peer, std::vector<uint8_t> & data) = 0;
+};
+
+// Rings in a POSIX shared memory segment, for ranks on one host. Every rank
+// opens the segment called name and the last one to attach unlinks it again.
+// Returns nullptr with the reason on simulation_log.
+halo_transport * create_shm_transport(const std::string & name, int rank, int ranks);
+
+// Stream sockets, addresses[rank] is host:port for TCP or unix:path for a
+// local socket. Every rank accepts the rank above it on its own address and
+// connects to the address of the rank below it. Returns nullptr with the
+// reason on simulation_log.
+halo_transport * create_socket_transport(const std::vector<std::string> & addresses, int rank);